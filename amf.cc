@@ -1,6 +1,7 @@
 #include "amf.h"
 #include "utils.h"
 #include <stdexcept>
+#include <memory>
 #include <string.h>
 #include <arpa/inet.h>
 
@@ -30,111 +31,75 @@ uint8_t get_byte(Decoder *dec)
 
 }
 
-AMFValue::AMFValue(AMFType type) :
-	m_type(type)
+Arena::Arena() :
+	m_pos(m_inline), m_left(sizeof m_inline)
 {
-	switch (m_type) {
-	case AMF_OBJECT:
-	case AMF_ECMA_ARRAY:
-		m_value.object = new amf_object_t;
-		break;
-	case AMF_NUMBER:
-	case AMF_INTEGER:
-	case AMF_NULL:
-	case AMF_UNDEFINED:
-		break;
-	default:
-		assert(0);
-	}
-}
-
-AMFValue::AMFValue(const std::string &s) :
-	m_type(AMF_STRING)
-{
-	m_value.string = new std::string(s);
 }
 
-AMFValue::AMFValue(double n) :
-	m_type(AMF_NUMBER)
+Arena::~Arena()
 {
-	m_value.number = n;
-}
-
-AMFValue::AMFValue(int i) :
-	m_type(AMF_INTEGER)
-{
-	m_value.integer = i;
+	FOR_EACH(std::vector<char *>, i, m_blocks) {
+		delete[] *i;
+	}
 }
 
-AMFValue::AMFValue(bool b) :
-	m_type(AMF_BOOLEAN)
+void *Arena::alloc(size_t len)
 {
-	m_value.boolean = b;
+	len = (len + 7) & ~size_t(7);
+	if (len > m_left) {
+		size_t size = 4096;
+		while (size < len)
+			size *= 2;
+		m_blocks.push_back(new char[size]);
+		m_pos = m_blocks.back();
+		m_left = size;
+	}
+	void *p = m_pos;
+	m_pos += len;
+	m_left -= len;
+	return p;
 }
 
-AMFValue::AMFValue(const amf_object_t &object) :
-	m_type(AMF_OBJECT)
+AMFValue AMFValue::object(Arena *arena, const AMFProperty *props,
+			  size_t count, AMFType type)
 {
-	m_value.object = new amf_object_t(object);
+	assert(type == AMF_OBJECT || type == AMF_ECMA_ARRAY);
+	AMFProperty *items = NULL;
+	if (count > 0) {
+		items = (AMFProperty *) arena->alloc(sizeof(AMFProperty) * count);
+		std::uninitialized_copy(props, props + count, items);
+	}
+	return borrow(items, count, type);
 }
 
-AMFValue::AMFValue(const AMFValue &from) :
-	m_type(AMF_NULL)
+AMFValue AMFValue::borrow(const AMFProperty *props, size_t count,
+			  AMFType type)
 {
-	*this = from;
+	assert(type == AMF_OBJECT || type == AMF_ECMA_ARRAY);
+	AMFValue value;
+	value.m_type = type;
+	value.m_value.object.items = props;
+	value.m_value.object.count = count;
+	return value;
 }
 
-AMFValue::~AMFValue()
+AMFValue AMFValue::object(Arena *arena,
+			  std::initializer_list<AMFProperty> props,
+			  AMFType type)
 {
-	destroy();
+	return object(arena, props.begin(), props.size(), type);
 }
 
-void AMFValue::destroy()
+AMFValue AMFValue::get(std::string_view key) const
 {
-	switch (m_type) {
-	case AMF_STRING:
-		delete m_value.string;
-		break;
-	case AMF_OBJECT:
-	case AMF_ECMA_ARRAY:
-		delete m_value.object;
-		break;
-	case AMF_NULL:
-	case AMF_NUMBER:
-	case AMF_INTEGER:
-	case AMF_BOOLEAN:
-	case AMF_UNDEFINED:
-		break;
+	for (const AMFProperty *i = begin(); i != end(); ++i) {
+		if (i->key == key)
+			return i->value;
 	}
+	return AMFValue(AMF_UNDEFINED);
 }
 
-void AMFValue::operator = (const AMFValue &from)
-{
-	destroy();
-	m_type = from.m_type;
-	switch (m_type) {
-	case AMF_STRING:
-		m_value.string = new std::string(*from.m_value.string);
-		break;
-	case AMF_OBJECT:
-	case AMF_ECMA_ARRAY:
-		m_value.object = new amf_object_t(*from.m_value.object);
-		break;
-	case AMF_NUMBER:
-		m_value.number = from.m_value.number;
-		break;
-	case AMF_INTEGER:
-		m_value.integer = from.m_value.integer;
-		break;
-	case AMF_BOOLEAN:
-		m_value.boolean = from.m_value.boolean;
-		break;
-	default:
-		break;
-	}
-}
-
-void amf_write(Encoder *enc, const std::string &s)
+void amf_write(Encoder *enc, std::string_view s)
 {
 	enc->buf += char(AMF0_STRING);
 	uint16_t str_len = htons(s.size());
@@ -142,11 +107,6 @@ void amf_write(Encoder *enc, const std::string &s)
 	enc->buf += s;
 }
 
-void amf_write(Encoder *enc, int i)
-{
-	throw std::runtime_error("AMF0 does not have integers");
-}
-
 void amf_write(Encoder *enc, double n)
 {
 	enc->buf += char(AMF0_NUMBER);
@@ -167,37 +127,25 @@ void amf_write(Encoder *enc, bool b)
 	enc->buf += char(b);
 }
 
-void amf_write_key(Encoder *enc, const std::string &s)
+void amf_write_key(Encoder *enc, std::string_view s)
 {
 	uint16_t str_len = htons(s.size());
 	enc->buf.append((char *) &str_len, 2);
 	enc->buf += s;
 }
 
-void amf_write(Encoder *enc, const amf_object_t &object)
+namespace {
+
+void write_properties(Encoder *enc, const AMFValue &object)
 {
-	enc->buf += char(AMF0_OBJECT);
-	for (amf_object_t::const_iterator i = object.begin();
-					  i != object.end(); ++i) {
-		amf_write_key(enc, i->first);
-		amf_write(enc, i->second);
+	for (const AMFProperty *i = object.begin(); i != object.end(); ++i) {
+		amf_write_key(enc, i->key);
+		amf_write(enc, i->value);
 	}
 	amf_write_key(enc, "");
 	enc->buf += char(AMF0_OBJECT_END);
 }
 
-void amf_write_ecma(Encoder *enc, const amf_object_t &object)
-{
-	enc->buf += char(AMF0_ECMA_ARRAY);
-	uint32_t zero = 0;
-	enc->buf.append((char *) &zero, 4);
-	for (amf_object_t::const_iterator i = object.begin();
-					  i != object.end(); ++i) {
-		amf_write_key(enc, i->first);
-		amf_write(enc, i->second);
-	}
-	amf_write_key(enc, "");
-	enc->buf += char(AMF0_OBJECT_END);
 }
 
 void amf_write_null(Encoder *enc)
@@ -215,20 +163,27 @@ void amf_write(Encoder *enc, const AMFValue &value)
 		amf_write(enc, value.as_number());
 		break;
 	case AMF_INTEGER:
-		amf_write(enc, value.as_integer());
-		break;
+		throw std::runtime_error("AMF0 does not have integers");
 	case AMF_BOOLEAN:
 		amf_write(enc, value.as_boolean());
 		break;
 	case AMF_OBJECT:
-		amf_write(enc, value.as_object());
+		enc->buf += char(AMF0_OBJECT);
+		write_properties(enc, value);
 		break;
-	case AMF_ECMA_ARRAY:
-		amf_write_ecma(enc, value.as_object());
+	case AMF_ECMA_ARRAY: {
+		enc->buf += char(AMF0_ECMA_ARRAY);
+		uint32_t count = htonl(value.end() - value.begin());
+		enc->buf.append((char *) &count, 4);
+		write_properties(enc, value);
 		break;
+	}
 	case AMF_NULL:
 		amf_write_null(enc);
 		break;
+	case AMF_UNDEFINED:
+		enc->buf += char(AMF0_UNDEFINED);
+		break;
 	}
 }
 
@@ -249,7 +204,7 @@ unsigned int load_amf3_integer(Decoder *dec)
 	return value;
 }
 
-std::string amf_load_string(Decoder *dec)
+std::string_view amf_load_string_view(Decoder *dec)
 {
 	size_t str_len = 0;
 	uint8_t type = get_byte(dec);
@@ -272,11 +227,16 @@ std::string amf_load_string(Decoder *dec)
 	if (dec->pos + str_len > dec->buf.size()) {
 		throw std::runtime_error("Not enough data");
 	}
-	std::string s(dec->buf, dec->pos, str_len);
+	std::string_view s = dec->buf.substr(dec->pos, str_len);
 	dec->pos += str_len;
 	return s;
 }
 
+std::string amf_load_string(Decoder *dec)
+{
+	return std::string(amf_load_string_view(dec));
+}
+
 double amf_load_number(Decoder *dec)
 {
 	if (get_byte(dec) != AMF0_NUMBER) {
@@ -313,7 +273,7 @@ bool amf_load_boolean(Decoder *dec)
 	return get_byte(dec) != 0;
 }
 
-std::string amf_load_key(Decoder *dec)
+std::string_view amf_load_key(Decoder *dec)
 {
 	if (dec->pos + 2 > dec->buf.size()) {
 		throw std::runtime_error("Not enough data");
@@ -323,34 +283,55 @@ std::string amf_load_key(Decoder *dec)
 	if (dec->pos + str_len > dec->buf.size()) {
 		throw std::runtime_error("Not enough data");
 	}
-	std::string s(dec->buf, dec->pos, str_len);
+	std::string_view s = dec->buf.substr(dec->pos, str_len);
 	dec->pos += str_len;
 	return s;
 }
 
-amf_object_t amf_load_object(Decoder *dec)
+namespace {
+
+/* Loads key/value pairs up to the object end marker */
+AMFValue load_properties(Decoder *dec, AMFType type)
 {
-	amf_object_t object;
-	if (get_byte(dec) != AMF0_OBJECT) {
-		throw std::runtime_error("Expected an object");
-	}
+	AMFProperty *items = NULL;
+	size_t count = 0, size = 0;
 	while (1) {
-		std::string key = amf_load_key(dec);
+		std::string_view key = amf_load_key(dec);
 		if (key.empty())
 			break;
 		AMFValue value = amf_load(dec);
-		object.insert(std::make_pair(key, value));
+		if (count == size) {
+			/* grow inside the arena, the old array is left behind */
+			size = size ? size * 2 : 8;
+			AMFProperty *grown = (AMFProperty *)
+				dec->arena->alloc(sizeof(AMFProperty) * size);
+			std::uninitialized_copy(items, items + count, grown);
+			items = grown;
+		}
+		items[count].key = key;
+		items[count].value = value;
+		count++;
 	}
 	if (get_byte(dec) != AMF0_OBJECT_END) {
 		throw std::runtime_error("expected object end");
 	}
-	return object;
+	/* the properties are already in the arena, no need to copy again */
+	return AMFValue::borrow(items, count, type);
+}
+
+}
+
+AMFValue amf_load_object(Decoder *dec)
+{
+	if (get_byte(dec) != AMF0_OBJECT) {
+		throw std::runtime_error("Expected an object");
+	}
+	return load_properties(dec, AMF_OBJECT);
 }
 
-amf_object_t amf_load_ecma(Decoder *dec)
+AMFValue amf_load_ecma(Decoder *dec)
 {
-	/* ECMA array is the same as object, with 4 extra zero bytes */
-	amf_object_t object;
+	/* ECMA array is the same as object, with an extra count */
 	if (get_byte(dec) != AMF0_ECMA_ARRAY) {
 		throw std::runtime_error("Expected an ECMA array");
 	}
@@ -358,17 +339,7 @@ amf_object_t amf_load_ecma(Decoder *dec)
 		throw std::runtime_error("Not enough data");
 	}
 	dec->pos += 4;
-	while (1) {
-		std::string key = amf_load_key(dec);
-		if (key.empty())
-			break;
-		AMFValue value = amf_load(dec);
-		object.insert(std::make_pair(key, value));
-	}
-	if (get_byte(dec) != AMF0_OBJECT_END) {
-		throw std::runtime_error("expected object end");
-	}
-	return object;
+	return load_properties(dec, AMF_ECMA_ARRAY);
 }
 
 AMFValue amf_load(Decoder *dec)
@@ -377,7 +348,7 @@ AMFValue amf_load(Decoder *dec)
 	if (dec->version == 3) {
 		switch (type) {
 		case AMF3_STRING:
-			return AMFValue(amf_load_string(dec));
+			return AMFValue(amf_load_string_view(dec));
 		case AMF3_NUMBER:
 			return AMFValue(amf_load_number(dec));
 		case AMF3_INTEGER:
@@ -389,9 +360,9 @@ AMFValue amf_load(Decoder *dec)
 			dec->pos++;
 			return AMFValue(true);
 		case AMF3_OBJECT:
-			return AMFValue(amf_load_object(dec));
+			return amf_load_object(dec);
 		case AMF3_ARRAY:
-			return AMFValue(amf_load_ecma(dec));
+			return amf_load_ecma(dec);
 		case AMF3_NULL:
 			dec->pos++;
 			return AMFValue(AMF_NULL);
@@ -404,15 +375,15 @@ AMFValue amf_load(Decoder *dec)
 	} else {
 		switch (type) {
 		case AMF0_STRING:
-			return AMFValue(amf_load_string(dec));
+			return AMFValue(amf_load_string_view(dec));
 		case AMF0_NUMBER:
 			return AMFValue(amf_load_number(dec));
 		case AMF0_BOOLEAN:
 			return AMFValue(amf_load_boolean(dec));
 		case AMF0_OBJECT:
-			return AMFValue(amf_load_object(dec));
+			return amf_load_object(dec);
 		case AMF0_ECMA_ARRAY:
-			return AMFValue(amf_load_ecma(dec));
+			return amf_load_ecma(dec);
 		case AMF0_NULL:
 			dec->pos++;
 			return AMFValue(AMF_NULL);
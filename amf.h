@@ -2,7 +2,9 @@
 #define __amf_h
 
 #include <string>
-#include <map>
+#include <string_view>
+#include <vector>
+#include <initializer_list>
 #include <assert.h>
 
 enum AMFType {
@@ -53,44 +55,114 @@ enum {
 	AMF3_BYTE_ARRAY,
 };
 
+/*
+ * Bump allocator for AMF values. Everything allocated from it is released
+ * at once when the arena goes away. The first block lives inside the arena
+ * itself, so decoding a typical command needs no heap allocations at all.
+ */
+class Arena {
+public:
+	Arena();
+	~Arena();
+
+	void *alloc(size_t len);
+
+private:
+	alignas(8) char m_inline[1024];
+	std::vector<char *> m_blocks;
+	char *m_pos;
+	size_t m_left;
+
+	Arena(const Arena &);
+	void operator = (const Arena &);
+};
+
+class AMFValue;
+
+/*
+ * Decodes from a buffer owned by the caller, which must outlive it. Decoded
+ * strings point into the buffer, and objects are allocated from the arena.
+ */
 struct Decoder {
-	std::string buf;
+	std::string_view buf;
 	size_t pos;
 	int version;
+	Arena *arena;
 };
 
 struct Encoder {
 	std::string buf;
 };
 
-class AMFValue;
-
-typedef std::map<std::string, AMFValue> amf_object_t;
+struct AMFProperty;
 
+/*
+ * A decoded or constructed AMF value. Values do not own anything: strings
+ * and object properties are borrowed from the decoded buffer, the arena or
+ * the caller, so copying a value is cheap and never copies a tree.
+ */
 class AMFValue {
 public:
-	AMFValue(AMFType type = AMF_NULL);
-	AMFValue(const std::string &s);
-	AMFValue(double n);
-	AMFValue(int i);
-	AMFValue(bool b);
-	AMFValue(const amf_object_t &object);
-	AMFValue(const AMFValue &from);
-	~AMFValue();
+	AMFValue(AMFType type = AMF_NULL) :
+		m_type(type)
+	{
+		assert(type == AMF_NULL || type == AMF_UNDEFINED);
+	}
+	AMFValue(const char *s) :
+		m_type(AMF_STRING)
+	{
+		set_string(s);
+	}
+	AMFValue(std::string_view s) :
+		m_type(AMF_STRING)
+	{
+		set_string(s);
+	}
+	AMFValue(const std::string &s) :
+		m_type(AMF_STRING)
+	{
+		set_string(s);
+	}
+	AMFValue(double n) :
+		m_type(AMF_NUMBER)
+	{
+		m_value.number = n;
+	}
+	AMFValue(int i) :
+		m_type(AMF_INTEGER)
+	{
+		m_value.integer = i;
+	}
+	AMFValue(bool b) :
+		m_type(AMF_BOOLEAN)
+	{
+		m_value.boolean = b;
+	}
+
+	/* Copies the properties (but not the strings) to the arena */
+	static AMFValue object(Arena *arena,
+			       std::initializer_list<AMFProperty> props,
+			       AMFType type = AMF_OBJECT);
+	static AMFValue object(Arena *arena, const AMFProperty *props,
+			       size_t count, AMFType type = AMF_OBJECT);
+	/* Refers to properties that must outlive the value */
+	static AMFValue borrow(const AMFProperty *props, size_t count,
+			       AMFType type = AMF_OBJECT);
 
 	AMFType type() const { return m_type; }
 
-	std::string as_string() const
+	std::string_view as_string() const
 	{
 		assert(m_type == AMF_STRING);
-		return *m_value.string;
+		return std::string_view(m_value.string.data,
+					m_value.string.len);
 	}
 	double as_number() const
 	{
 		assert(m_type == AMF_NUMBER);
 		return m_value.number;
 	}
-	double as_integer() const
+	int as_integer() const
 	{
 		assert(m_type == AMF_INTEGER);
 		return m_value.integer;
@@ -100,57 +172,74 @@ public:
 		assert(m_type == AMF_BOOLEAN);
 		return m_value.boolean;
 	}
-	amf_object_t as_object() const
-	{
-		assert(m_type == AMF_OBJECT);
-		return *m_value.object;
-	}
-
-	AMFValue get(const std::string &s) const
-	{
-		assert(m_type == AMF_OBJECT);
-		amf_object_t::const_iterator i = m_value.object->find(s);
-		if (i == m_value.object->end())
-			return AMFValue();
-		return i->second;
-	}
 
-	void set(const std::string &s, const AMFValue &val)
+	/* Properties of an object or an ECMA array */
+	const AMFProperty *begin() const
 	{
-		assert(m_type == AMF_OBJECT);
-		m_value.object->insert(std::make_pair(s, val));
+		assert(m_type == AMF_OBJECT || m_type == AMF_ECMA_ARRAY);
+		return m_value.object.items;
 	}
+	const AMFProperty *end() const;
 
-	void operator = (const AMFValue &from);
+	/* Returns undefined if there is no such property */
+	AMFValue get(std::string_view key) const;
 
 private:
 	AMFType m_type;
 	union {
-		std::string *string;
+		struct {
+			const char *data;
+			size_t len;
+		} string;
 		double number;
 		int integer;
 		bool boolean;
-		amf_object_t *object;
+		struct {
+			const AMFProperty *items;
+			size_t count;
+		} object;
 	} m_value;
 
-	void destroy();
+	void set_string(std::string_view s)
+	{
+		m_value.string.data = s.data();
+		m_value.string.len = s.size();
+	}
+};
+
+struct AMFProperty {
+	std::string_view key;
+	AMFValue value;
 };
 
-void amf_write(Encoder *enc, const std::string &s);
+inline const AMFProperty *AMFValue::end() const
+{
+	return begin() + m_value.object.count;
+}
+
+void amf_write(Encoder *enc, std::string_view s);
+inline void amf_write(Encoder *enc, const char *s)
+{
+	amf_write(enc, std::string_view(s));
+}
+inline void amf_write(Encoder *enc, const std::string &s)
+{
+	amf_write(enc, std::string_view(s));
+}
 void amf_write(Encoder *enc, double n);
 void amf_write(Encoder *enc, bool b);
-void amf_write_key(Encoder *enc, const std::string &s);
-void amf_write(Encoder *enc, const amf_object_t &object);
-void amf_write_ecma(Encoder *enc, const amf_object_t &object);
+void amf_write_key(Encoder *enc, std::string_view s);
 void amf_write_null(Encoder *enc);
 void amf_write(Encoder *enc, const AMFValue &value);
 
 std::string amf_load_string(Decoder *dec);
+/* The returned view points into the decoded buffer */
+std::string_view amf_load_string_view(Decoder *dec);
 double amf_load_number(Decoder *dec);
 bool amf_load_boolean(Decoder *dec);
-std::string amf_load_key(Decoder *dec);
-amf_object_t amf_load_object(Decoder *dec);
-amf_object_t amf_load_ecma(Decoder *dec);
+std::string_view amf_load_key(Decoder *dec);
+AMFValue amf_load_object(Decoder *dec);
+AMFValue amf_load_ecma(Decoder *dec);
 AMFValue amf_load(Decoder *dec);
 
 #endif
@@ -0,0 +1,172 @@
+#include "chunk.h"
+#include "rtmp.h"
+#include "utils.h"
+#include "pool.h"
+#include <stdexcept>
+
+ChunkParser::ChunkParser() :
+	chunk_len(DEFAULT_CHUNK_LEN), max_message(0), m_chunk_msg(NULL),
+	m_chunk_left(0), m_done(NULL)
+{
+	for (int i = 0; i < 64; ++i) {
+		m_messages[i].timestamp = 0;
+		m_messages[i].delta = 0;
+		m_messages[i].len = 0;
+	}
+}
+
+RTMP_Message *ChunkParser::next(RingBuffer *in)
+{
+	if (m_done) {
+		pool_free(m_done->buf);
+		m_done = NULL;
+	}
+	for (;;) {
+		if (m_chunk_left == 0) {
+			if (in->empty())
+				return NULL;
+			uint8_t flags = in->at(0);
+
+			static const size_t HEADER_LENGTH[] = {12, 8, 4, 1};
+			size_t header_len = HEADER_LENGTH[flags >> 6];
+
+			if (in->size() < header_len) {
+				/* need more data */
+				return NULL;
+			}
+
+			RTMP_Header header;
+			in->copy(0, &header, header_len);
+
+			RTMP_Message *msg = &m_messages[flags & 0x3f];
+
+			if (header_len >= 8) {
+				msg->len = load_be24(header.msg_len);
+				if (msg->len < msg->buf.size()) {
+					throw std::runtime_error("invalid msg length");
+				}
+				msg->type = header.msg_type;
+			}
+			if (header_len >= 12) {
+				msg->endpoint = load_le32(header.endpoint);
+			}
+
+			if (msg->len == 0) {
+				throw std::runtime_error("message without a header");
+			}
+			/* also when a header in the middle of a message grows it */
+			if (msg->len > max_message) {
+				throw std::runtime_error(strf("too large message: %zu bytes",
+							      msg->len));
+			}
+
+			if (header_len >= 4) {
+				unsigned long ts = load_be24(header.timestamp);
+				if (ts == 0xffffff) {
+					throw std::runtime_error("ext timestamp not supported");
+				}
+				msg->delta = ts;
+				if (header_len < 12) {
+					ts += msg->timestamp;
+				}
+				msg->timestamp = ts;
+			} else if (msg->buf.empty()) {
+				/* a new message repeats the previous delta */
+				msg->timestamp += msg->delta;
+			}
+
+			if (msg->buf.empty()) {
+				/* a new message */
+				msg->buf = pool_alloc(msg->len);
+			}
+
+			size_t chunk = msg->len - msg->buf.size();
+			if (chunk > chunk_len)
+				chunk = chunk_len;
+
+			in->consume(header_len);
+			m_chunk_msg = msg;
+			m_chunk_left = chunk;
+		}
+
+		size_t len = in->size();
+		if (len == 0)
+			return NULL;
+		if (len > m_chunk_left)
+			len = m_chunk_left;
+
+		RTMP_Message *msg = m_chunk_msg;
+		in->append_to(msg->buf, 0, len);
+		in->consume(len);
+		m_chunk_left -= len;
+
+		if (m_chunk_left == 0 && msg->buf.size() == msg->len) {
+			m_done = msg;
+			return msg;
+		}
+	}
+}
+
+std::string chunk_body(const std::string &buf, int channel_num,
+		       size_t chunk_len)
+{
+	std::string out = pool_alloc(buf.size() + buf.size() / chunk_len);
+
+	size_t pos = 0;
+	while (pos < buf.size()) {
+		if (pos) {
+			uint8_t flags = (channel_num & 0x3f) | (3 << 6);
+			out += char(flags);
+		}
+
+		size_t chunk = buf.size() - pos;
+		if (chunk > chunk_len)
+			chunk = chunk_len;
+		out.append(buf, pos, chunk);
+		pos += chunk;
+	}
+	return out;
+}
+
+size_t chunk_header(ChunkStream *cs, char *out, int channel_num,
+		    uint8_t type, uint32_t endpoint, size_t len,
+		    unsigned long timestamp)
+{
+	unsigned long delta = timestamp - cs->timestamp;
+	int fmt;
+	if (!cs->valid || cs->endpoint != endpoint ||
+	    timestamp < cs->timestamp || delta >= 0xffffff) {
+		fmt = 0;
+	} else if (cs->type != type || cs->len != len) {
+		fmt = 1;
+	} else if (!cs->has_delta || cs->delta != delta) {
+		fmt = 2;
+	} else {
+		fmt = 3;
+	}
+
+	size_t pos = 0;
+	out[pos++] = (channel_num & 0x3f) | (fmt << 6);
+	if (fmt <= 2) {
+		set_be24(&out[pos], fmt == 0 ? timestamp : delta);
+		pos += 3;
+	}
+	if (fmt <= 1) {
+		set_be24(&out[pos], len);
+		out[pos + 3] = type;
+		pos += 4;
+	}
+	if (fmt == 0) {
+		set_le32(&out[pos], endpoint);
+		pos += 4;
+	}
+
+	cs->valid = true;
+	cs->has_delta = fmt != 0;
+	cs->endpoint = endpoint;
+	cs->type = type;
+	cs->len = len;
+	cs->timestamp = timestamp;
+	cs->delta = fmt == 0 ? 0 : delta;
+	return pos;
+}
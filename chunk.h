@@ -0,0 +1,76 @@
+#ifndef __chunk_h
+#define __chunk_h
+
+#include "ring.h"
+#include <string>
+#include <stdint.h>
+
+#define MAX_CHUNK_HEADER	12
+
+struct RTMP_Message {
+	uint8_t type;
+	size_t len;
+	unsigned long timestamp;
+	unsigned long delta; /* of the last header, repeated by fmt 3 */
+	uint32_t endpoint;
+	std::string buf;
+};
+
+/*
+ * Reassembles the messages of a received chunk stream. Keeps no reference
+ * to the connection, so it can be fed from anywhere.
+ */
+class ChunkParser {
+public:
+	ChunkParser();
+
+	size_t chunk_len; /* set by the peer */
+	size_t max_message; /* larger messages are refused */
+
+	/*
+	 * Consumes data until a message is complete, and returns it. Returns
+	 * NULL if more data is needed. The message stays valid until the next
+	 * call, which takes its buffer back to the pool.
+	 */
+	RTMP_Message *next(RingBuffer *in);
+
+private:
+	RTMP_Message m_messages[64];
+	RTMP_Message *m_chunk_msg; /* message of the chunk being received */
+	size_t m_chunk_left; /* bytes left of the chunk being received */
+	RTMP_Message *m_done; /* returned by the last call */
+
+	ChunkParser(const ChunkParser &);
+	void operator = (const ChunkParser &);
+};
+
+/*
+ * The last message header sent on an outbound chunk stream. The next header
+ * only needs to carry the fields that changed.
+ */
+struct ChunkStream {
+	bool valid;
+	bool has_delta; /* timestamp delta is known to the peer */
+	uint32_t endpoint;
+	uint8_t type;
+	size_t len;
+	unsigned long timestamp;
+	unsigned long delta;
+};
+
+/*
+ * Serializes a message body into its chunked wire form, without the header
+ * of the first chunk. The continuation headers are the same for everyone.
+ */
+std::string chunk_body(const std::string &buf, int channel_num,
+		       size_t chunk_len);
+
+/*
+ * Builds the header of the first chunk of a message, as short as the
+ * previous message on the same chunk stream allows. Returns the length.
+ */
+size_t chunk_header(ChunkStream *cs, char *out, int channel_num,
+		    uint8_t type, uint32_t endpoint, size_t len,
+		    unsigned long timestamp);
+
+#endif
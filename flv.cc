@@ -0,0 +1,71 @@
+#include "flv.h"
+#include "rtmp.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+const std::string &flv_file_header()
+{
+	static const char header[] = {
+		'F', 'L', 'V', 1,
+		0x05, /* audio and video */
+		0, 0, 0, FLV_HEADER_LEN, /* header size */
+		0, 0, 0, 0, /* size of the previous tag */
+	};
+	static const std::string str(header, sizeof header);
+	return str;
+}
+
+void flv_write_tag_header(char *out, uint8_t type, unsigned long timestamp,
+			  size_t len)
+{
+	out[0] = type;
+	set_be24(&out[1], len);
+	set_be24(&out[4], timestamp);
+	out[7] = timestamp >> 24;
+	set_be24(&out[8], 0); /* stream id */
+}
+
+size_t flv_read_tag_header(const char *in, uint8_t *type,
+			   unsigned long *timestamp)
+{
+	*type = in[0] & 0x1f;
+	*timestamp = load_be24(&in[4]) | ((unsigned long) uint8_t(in[7]) << 24);
+	return load_be24(&in[1]);
+}
+
+void flv_write_tag_size(char *out, size_t len)
+{
+	uint32_t tag_size = htonl(FLV_TAG_HEADER + len);
+	memcpy(out, &tag_size, FLV_TAG_SIZE);
+}
+
+void flv_append_tag(std::string *out, uint8_t type, unsigned long timestamp,
+		    const std::string &data)
+{
+	char header[FLV_TAG_HEADER];
+	flv_write_tag_header(header, type, timestamp, data.size());
+	out->append(header, sizeof header);
+	*out += data;
+	char size[FLV_TAG_SIZE];
+	flv_write_tag_size(size, data.size());
+	out->append(size, sizeof size);
+}
+
+bool flv_is_sequence_header(uint8_t type, const char *data, size_t len)
+{
+	if (len < 2 || data[1] != FLV_SEQUENCE_HEADER)
+		return false;
+	uint8_t flags = data[0];
+	if (type == MSG_VIDEO) {
+		return flags >> 4 == FLV_KEY_FRAME &&
+			(flags & 0x0f) == FLV_CODEC_AVC;
+	}
+	return type == MSG_AUDIO && flags >> 4 == FLV_AUDIO_AAC;
+}
+
+bool flv_is_keyframe(uint8_t type, const char *data, size_t len)
+{
+	return type == MSG_VIDEO && len > 0 &&
+		uint8_t(data[0]) >> 4 == FLV_KEY_FRAME;
+}
@@ -0,0 +1,39 @@
+#ifndef __flv_h
+#define __flv_h
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * FLV file framing, shared by the recorder, the files played on demand and
+ * the HTTP-FLV viewers. The tag types are the same as the RTMP message
+ * types.
+ */
+
+#define FLV_HEADER_LEN	9
+#define FLV_TAG_HEADER	11
+#define FLV_TAG_SIZE	4	/* trails every tag */
+
+/* The file header and the size of the non-existent previous tag */
+const std::string &flv_file_header();
+
+void flv_write_tag_header(char *out, uint8_t type, unsigned long timestamp,
+			  size_t len);
+
+/* Reads a tag header, returns the length of the data */
+size_t flv_read_tag_header(const char *in, uint8_t *type,
+			   unsigned long *timestamp);
+
+void flv_write_tag_size(char *out, size_t len);
+
+/* Appends a complete tag: header, data and size */
+void flv_append_tag(std::string *out, uint8_t type, unsigned long timestamp,
+		    const std::string &data);
+
+/* Tells if audio or video data is an AAC or AVC sequence header */
+bool flv_is_sequence_header(uint8_t type, const char *data, size_t len);
+
+bool flv_is_keyframe(uint8_t type, const char *data, size_t len);
+
+#endif
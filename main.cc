@@ -8,7 +8,22 @@
 #include "amf.h"
 #include "utils.h"
 #include "rtmp.h"
+#include "queue.h"
+#include "ring.h"
+#include "pool.h"
+#include "chunk.h"
+#include "recorder.h"
+#include "vod.h"
+#include "flv.h"
+#include "metrics.h"
 #include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <map>
 #include <stdexcept>
 #include <stdio.h>
 #include <string.h>
@@ -17,41 +32,375 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
-#include <sys/poll.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+
+#define MAX_WORKERS		64
+#define INBOX_LEN		256	/* events from one worker */
+#define BACKLOG_TICK		1	/* ms */
+#define HANDSHAKE_POOL_LEN	64
+#define DEFAULT_GOP_CACHE	4096	/* KB */
+#define DEFAULT_QUEUE_LEN	4096	/* KB */
+#define DEFAULT_QUEUE_TIME	10000	/* ms */
+#define MAX_RECV_BUF		(256 * 1024)
+#define DEFAULT_MAX_MESSAGE	8192	/* KB */
+#define DEFAULT_RECORD_SIZE	1024	/* MB */
+#define DEFAULT_RECORD_TIME	3600	/* s */
+#define MAX_CONTROL_MESSAGE	(64 * 1024)
+#define DEFAULT_OUT_CHUNK	4096
+#define MAX_OUT_CHUNK		65536
+#define MAX_PEER_CHUNK		0x7fffffff
+#define VOD_TICK		10	/* ms */
+#define VOD_BUFFER		1000	/* ms sent ahead of the playback clock */
+#define VOD_QUEUE_LEN		(256 * 1024)
+#define MAX_HTTP_REQUEST	4096
+#define RATE_WINDOW		1000	/* ms of media */
+#define RELAY_CHECK		1000000	/* us between counting the viewers */
+#define RELAY_TIMEOUT		10000000	/* us without data from the origin */
+#define RETRY_MIN		1000000	/* us, before connecting a push or relay again */
+#define RETRY_MAX		30000000
+
+enum ClientKind {
+	CLIENT_RTMP,
+	CLIENT_METRICS, /* HTTP request for the metrics */
+	CLIENT_RELAY, /* our connection to the origin, publishing locally */
+	CLIENT_PUSH, /* our connection to a push target, playing locally */
+	CLIENT_HTTP, /* HTTP-FLV viewer */
+};
 
-#define APP_NAME	"live"
+enum HandshakeState {
+	HANDSHAKE_C0C1,
+	HANDSHAKE_C2,
+	HANDSHAKE_S0S1S2, /* we are the client */
+	HANDSHAKE_DONE,
+};
 
-struct RTMP_Message {
-	uint8_t type;
+/*
+ * Part of a shared buffer or a mapped file, or a chunk header, waiting in a
+ * send queue
+ */
+struct Segment {
+	std::shared_ptr<const void> owner; /* NULL if the bytes are in header */
+	const char *base; /* data kept alive by the owner */
+	size_t pos;
 	size_t len;
+	bool media_end; /* last segment of a media message */
+	unsigned long timestamp; /* of the media message */
+	/* Of a relayed live message, in us, or 0 */
+	uint64_t recv_time; /* when received from the publisher */
+	uint64_t queue_time; /* when queued to this client */
+	bool traced; /* print the latencies once sent */
+	char header[MAX_CHUNK_HEADER]; /* built for this client only */
+
+	Segment() :
+		base(NULL), pos(0), len(0), media_end(false), timestamp(0),
+		recv_time(0), queue_time(0), traced(false)
+	{
+	}
+
+	const char *data() const
+	{
+		return (owner ? base : header) + pos;
+	}
+};
+
+struct Stream;
+
+/* Stands in for media dropped on the way to a worker with a full inbox */
+#define EVENT_GAP		0xff
+
+/*
+ * Published message handed from the publisher's worker to every worker,
+ * which then relays it to its own clients.
+ */
+struct StreamEvent {
+	std::shared_ptr<Stream> stream;
+	/* MSG_AUDIO, MSG_VIDEO, MSG_NOTIFY, EVENT_GAP or 0 for end of stream */
+	uint8_t type;
 	unsigned long timestamp;
-	uint32_t endpoint;
-	std::string buf;
+	shared_buf_t buf;
+	uint64_t recv_time; /* us, when the read completing it returned */
+	bool traced; /* sampled for latency tracing */
 };
 
+struct Worker;
+struct Push;
+struct Relay;
+
 struct Client {
+	Worker *worker;
 	int fd;
+	ClientKind kind;
+	uint64_t id; /* unique, for the metrics */
+	bool request_done; /* HTTP request has been read */
+	bool hangup; /* close once the send queue is empty */
+	HandshakeState handshake_state;
+	size_t handshake_sig; /* offset of our S0+S1 in the handshake pool */
+	std::string app;
+	std::shared_ptr<Stream> stream; /* being played or published */
+	size_t stream_index; /* position in the stream's local subscribers */
+	uint32_t stream_id; /* of the media we send, chosen by a push target */
+	Push *push; /* forwarded over this connection */
+	Relay *relay; /* pulled over this connection */
+	bool publishing;
+	std::shared_ptr<Recording> recording; /* of the published stream */
 	bool playing; /* Wants to receive the stream? */
 	bool ready; /* Wants to receive and seen a keyframe */
-	RTMP_Message messages[64];
-	std::string buf;
-	std::string send_queue;
-	size_t chunk_len;
-	uint32_t written_seq;
-	uint32_t read_seq;
+	RingBuffer buf; /* received data */
+	ChunkParser parser;
+	std::deque<Segment> send_queue;
+	size_t queued; /* bytes in send_queue */
+	size_t burst_left; /* of queued, sent on purpose when joining a stream */
+	unsigned long queued_ts; /* timestamp of the newest queued media */
+	unsigned long sent_ts; /* timestamp of the last fully sent media */
+	bool skip_video; /* dropping video until the next keyframe */
+	uint64_t dropped; /* media messages dropped due to congestion */
+	bool want_write; /* EPOLLOUT is enabled */
+	bool flush_pending; /* in flush_list */
+	size_t index; /* position in worker's clients */
+	size_t out_chunk_len; /* announced by us */
+	ChunkStream out_chunks[64];
+	uint32_t written_seq; /* bytes queued to the peer */
+	uint32_t read_seq; /* bytes acknowledged by the peer */
+	bool acks_seen; /* the peer sends acknowledgements */
+	uint32_t recv_seq; /* bytes received from the peer */
+	uint32_t acked_seq; /* recv_seq in our last acknowledgement */
+	uint32_t ack_window; /* how often the peer wants acknowledgements */
+	std::shared_ptr<VodFile> vod; /* file being played */
+	size_t vod_index; /* position in worker's vod_clients */
+	size_t vod_pos; /* offset of the next tag to send */
+	unsigned long vod_ts; /* file timestamp at vod_clock */
+	uint64_t vod_clock; /* when playback started or resumed, in ms */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t recv_time; /* us, when the last read returned */
+	unsigned long trace_count; /* media messages received, for sampling */
+	/* Ingest of a publisher, measured over windows of media time */
+	unsigned long rate_start; /* timestamp starting the current window */
+	size_t rate_bytes;
+	size_t rate_frames;
+	double ingest_bitrate; /* bits per second in the last window */
+	double ingest_fps;
+	bool keyframe_seen;
+	unsigned long keyframe_ts; /* of the last keyframe */
+	unsigned long keyframe_interval; /* ms, 0 until two keyframes seen */
+};
+
+namespace {
+class SharedMessage;
+}
+
+typedef std::shared_ptr<SharedMessage> shared_msg_t;
+
+/* Stages of the path from a publisher to a viewer */
+enum LatencyStage {
+	STAGE_INGEST, /* from the read to the fan-out on a worker */
+	STAGE_QUEUE, /* from the fan-out until the last byte is sent */
+	STAGE_TOTAL, /* from the read until the last byte is sent */
+	NUM_STAGES
+};
+
+/* Latencies of a stream, since the start and since the last scrape */
+struct StreamLatency {
+	Histogram total[NUM_STAGES];
+	Histogram recent[NUM_STAGES];
+
+	void observe(int stage, uint64_t us)
+	{
+		total[stage].observe(us / 1e6);
+		recent[stage].observe(us / 1e6);
+	}
+
+	void merge(const StreamLatency &other)
+	{
+		for (int i = 0; i < NUM_STAGES; ++i) {
+			total[i].merge(other.total[i]);
+			recent[i].merge(other.recent[i]);
+		}
+	}
+};
+
+typedef std::map<std::string, StreamLatency> latency_map_t;
+
+/* The part of a stream owned by one worker, only touched by its thread */
+struct LocalStream {
+	std::vector<Client *> subscribers;
+	shared_msg_t metadata; /* onMetaData notify */
+	shared_msg_t push_metadata; /* the same for push targets, if needed */
+	/* Sent to new viewers: sequence headers and the current GOP */
+	shared_msg_t video_header;
+	shared_msg_t audio_header;
+	std::vector<shared_msg_t> gop;
+	size_t gop_bytes;
+	StreamLatency latency; /* of the messages relayed by this worker */
+
+	LocalStream() : gop_bytes(0) {}
+};
+
+/*
+ * A stream in the registry, named by "app/stream". The publisher and the
+ * counts are protected by registry_lock.
+ */
+struct Stream {
+	std::string name;
+	Client *publisher;
+	size_t viewers;
+	size_t pushes; /* connections forwarding it, not counted as viewers */
+	std::vector<LocalStream> local; /* indexed by worker */
+};
+
+/* A server we connect to, resolved at startup */
+struct Target {
+	std::string host; /* as given, host[:port] */
+	sockaddr_in addr;
+};
+
+/*
+ * A locally published stream forwarded to a push target. Owned by the
+ * worker of the publisher, and kept until the publisher goes away.
+ */
+struct Push {
+	std::shared_ptr<Stream> stream;
+	const Target *target;
+	Client *conn; /* NULL while waiting to reconnect */
+	uint64_t retry_at; /* us */
+	uint64_t backoff; /* us, doubled on every failure */
+};
+
+/*
+ * A stream pulled from the origin in edge mode. Owned by the worker that
+ * started pulling it, and kept while the stream has viewers.
+ */
+struct Relay {
+	std::shared_ptr<Stream> stream;
+	Client *conn; /* NULL while waiting to reconnect */
+	uint64_t retry_at; /* us */
+	uint64_t backoff; /* us, doubled on every failure */
+};
+
+/*
+ * Each worker thread runs its own event loop with its own listener and
+ * clients. Nothing in here is touched by other threads, except the inbox
+ * queues and the eventfd used to wake the worker up.
+ */
+struct Worker {
+	size_t id;
+	int listen_fd;
+	int epoll_fd;
+	int event_fd;
+	std::vector<Client *> clients;
+	/* Clients with newly queued data, flushed after handling the events */
+	std::vector<Client *> flush_list;
+	/* Clients closed during this iteration, deleted after the flush */
+	std::vector<Client *> closed_clients;
+	/* Clients playing files, paced by the worker */
+	std::vector<Client *> vod_clients;
+	/* Streams published on this worker, forwarded to the push targets */
+	std::vector<Push *> pushes;
+	/* Streams pulled from the origin by this worker */
+	std::vector<Relay *> relays;
+	uint64_t relays_checked; /* us, when their viewers were last counted */
+	/* Counters for the metrics, only touched by this thread */
+	uint64_t accepted;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t dropped;
+	Histogram loop_time;
+	/*
+	 * The scraping worker asks for a new round of samples through
+	 * metrics_wanted. The worker then renders its samples, by family,
+	 * into metrics.
+	 */
+	std::atomic<uint64_t> metrics_wanted;
+	std::mutex metrics_lock;
+	std::vector<std::string> metrics;
+	latency_map_t metrics_latency; /* merged over workers when scraped */
+	uint64_t metrics_round; /* of the samples in metrics */
+	int http_fd; /* HTTP-FLV listener, or -1 */
+	/* Only used by the first worker, which serves the metrics */
+	int metrics_fd;
+	uint64_t scrape_round;
+	std::vector<Client *> scrapers; /* waiting for the samples */
+	/* Stream events from other workers, indexed by the sending worker */
+	std::vector<SPSCQueue<StreamEvent> *> inbox;
+	/* Events that must not be dropped, waiting for a full inbox to drain */
+	std::vector<std::deque<StreamEvent> > backlog; /* by receiving worker */
+	/* Workers that have been sent events during this iteration */
+	std::vector<bool> wake_pending;
+	size_t next_sig; /* next block to use from the handshake pool */
 };
 
 namespace {
 
-amf_object_t metadata;
-Client *publisher = NULL;
-int listen_fd;
-std::vector<pollfd> poll_table;
-std::vector<Client *> clients;
+typedef std::unordered_map<std::string, std::shared_ptr<Stream> > registry_t;
+
+std::mutex registry_lock;
+registry_t streams;
+std::vector<Worker *> workers;
+size_t gop_cache_len = DEFAULT_GOP_CACHE * 1024;
+size_t max_queue_len = DEFAULT_QUEUE_LEN * 1024;
+unsigned long max_queue_time = DEFAULT_QUEUE_TIME;
+size_t out_chunk_len = DEFAULT_OUT_CHUNK;
+Recorder *recorder = NULL;
+const char *vod_dir = NULL;
+int listen_port = PORT;
+int metrics_port = 0;
+int http_port = 0;
+unsigned long trace_every = 0; /* print every nth message, 0 for none */
+/* Edge mode: streams without a local publisher are pulled from here */
+Target origin;
+/* Published streams are forwarded to all of these */
+std::vector<Target> push_targets;
+std::atomic<uint64_t> next_client_id(1);
+size_t max_message_len = DEFAULT_MAX_MESSAGE * 1024;
+/* Pre-generated S0+S1 blocks, handed out in turn to new clients */
+shared_buf_t handshake_pool;
+
+/*
+ * An encoded command with a hole for one variable field, such as the
+ * transaction id or a stream path. The constant parts are encoded once.
+ */
+struct Template {
+	std::string head;
+	std::string tail;
+
+	template<class T>
+	std::string fill(const T &value) const
+	{
+		Encoder enc;
+		enc.buf.reserve(head.size() + tail.size() + 64);
+		enc.buf = head;
+		amf_write(&enc, value);
+		enc.buf += tail;
+		return enc.buf;
+	}
+};
+
+/* Command messages sent to clients, built by init_templates() */
+struct Templates {
+	Template result;
+	Template connect_result;
+	Template createstream_result;
+	Template fcpublish_status;
+	Template publish_status;
+	std::string play_reset;
+	std::string play_start;
+	std::string sample_access;
+	std::string pause_notify;
+	std::string play_stop;
+	std::string seek_notify;
+};
+
+Templates templates;
 
 int set_nonblock(int fd, bool enabled)
 {
@@ -62,40 +411,16 @@ int set_nonblock(int fd, bool enabled)
 	return fcntl(fd, F_SETFL, flags);
 }
 
-size_t recv_all(int fd, void *buf, size_t len)
+uint64_t now_us()
 {
-	size_t pos = 0;
-	while (pos < len) {
-		ssize_t bytes = recv(fd, (char *) buf + pos, len - pos, 0);
-		if (bytes < 0) {
-			if (errno == EAGAIN || errno == EINTR)
-				continue;
-			throw std::runtime_error(
-				strf("unable to recv: %s", strerror(errno)));
-		}
-		if (bytes == 0)
-			break;
-		pos += bytes;
-	}
-	return pos;
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
 
-size_t send_all(int fd, const void *buf, size_t len)
+uint64_t now_ms()
 {
-	size_t pos = 0;
-	while (pos < len) {
-		ssize_t written = send(fd, (const char *) buf + pos, len - pos, 0);
-		if (written < 0) {
-			if (errno == EAGAIN || errno == EINTR)
-				continue;
-			throw std::runtime_error(
-				strf("unable to send: %s", strerror(errno)));
-		}
-		if (written == 0)
-			break;
-		pos += written;
-	}
-	return pos;
+	return now_us() / 1000;
 }
 
 bool is_safe(uint8_t b)
@@ -125,303 +450,1262 @@ void hexdump(const void *buf, size_t len)
 	}
 }
 
+/* Accounts the latency of a live message once its last byte is sent */
+void message_sent(Client *client, const Segment &seg, uint64_t now)
+{
+	StreamLatency &latency =
+		client->stream->local[client->worker->id].latency;
+	latency.observe(STAGE_QUEUE, now - seg.queue_time);
+	latency.observe(STAGE_TOTAL, now - seg.recv_time);
+	if (seg.traced) {
+		printf("trace %s ts %lu client %llu: ingest %llu us, "
+		       "queue %llu us, total %llu us\n",
+		       client->stream->name.c_str(), seg.timestamp,
+		       (unsigned long long) client->id,
+		       (unsigned long long) (seg.queue_time - seg.recv_time),
+		       (unsigned long long) (now - seg.queue_time),
+		       (unsigned long long) (now - seg.recv_time));
+	}
+}
+
 void try_to_send(Client *client)
 {
-	size_t len = client->send_queue.size();
-	if (len > 4096)
-		len = 4096;
+	while (!client->send_queue.empty()) {
+		iovec iov[IOV_MAX];
+		int count = 0;
+		FOR_EACH(std::deque<Segment>, i, client->send_queue) {
+			if (count == IOV_MAX)
+				break;
+			iov[count].iov_base = (char *) i->data();
+			iov[count].iov_len = i->len;
+			count++;
+		}
 
-	ssize_t written = send(client->fd, client->send_queue.data(), len, 0);
-	if (written < 0) {
-		if (errno == EAGAIN || errno == EINTR)
-			return;
-		throw std::runtime_error(strf("unable to write to a client: %s",
-						strerror(errno)));
+		msghdr hdr;
+		memset(&hdr, 0, sizeof hdr);
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = count;
+		ssize_t written = sendmsg(client->fd, &hdr, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			throw std::runtime_error(strf("unable to write to a client: %s",
+							strerror(errno)));
+		}
+
+		client->queued -= written;
+		client->burst_left -= std::min(client->burst_left,
+					       size_t(written));
+		client->bytes_out += written;
+		client->worker->bytes_out += written;
+
+		uint64_t now = 0;
+		size_t left = written;
+		while (left > 0) {
+			Segment &seg = client->send_queue.front();
+			if (left < seg.len) {
+				seg.pos += left;
+				seg.len -= left;
+				/* socket buffer is full */
+				return;
+			}
+			left -= seg.len;
+			if (seg.media_end) {
+				client->sent_ts = seg.timestamp;
+				if (seg.recv_time && client->stream) {
+					if (now == 0)
+						now = now_us();
+					message_sent(client, seg, now);
+				}
+			}
+			client->send_queue.pop_front();
+		}
 	}
+}
+
+void update_events(Client *client)
+{
+	bool want_write = !client->send_queue.empty();
+	if (want_write == client->want_write)
+		return;
 
-	client->send_queue.erase(0, written);
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	if (want_write)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = client;
+	if (epoll_ctl(client->worker->epoll_fd, EPOLL_CTL_MOD, client->fd,
+		      &ev) < 0) {
+		throw std::runtime_error(strf("epoll_ctl() failed: %s",
+					      strerror(errno)));
+	}
+	client->want_write = want_write;
 }
 
-void rtmp_send(Client *client, uint8_t type, uint32_t endpoint,
-		const std::string &buf, unsigned long timestamp = 0,
-		int channel_num = CHAN_CONTROL)
+void push_segment(Client *client, const Segment &seg)
 {
-	if (endpoint == STREAM_ID) {
-		/*
-		 * For some unknown reason, stream-related msgs must be sent
-		 * on a specific channel.
-		 */
-		channel_num = CHAN_STREAM;
+	/* try_to_send() would never get past an empty one */
+	if (seg.len == 0)
+		return;
+	client->send_queue.push_back(seg);
+	client->queued += seg.len;
+	client->written_seq += seg.len;
+
+	if (!client->flush_pending) {
+		client->flush_pending = true;
+		client->worker->flush_list.push_back(client);
 	}
+}
+
+void queue_send(Client *client, const shared_buf_t &data, size_t pos = 0,
+		size_t len = std::string::npos)
+{
+	if (len == std::string::npos)
+		len = data->size() - pos;
+
+	Segment seg;
+	seg.owner = data;
+	seg.base = data->data();
+	seg.pos = pos;
+	seg.len = len;
+	push_segment(client, seg);
+}
+
+/* Queues the header of the first chunk, built for this client */
+void queue_header(Client *client, int channel_num, uint8_t type,
+		  uint32_t endpoint, unsigned long timestamp, size_t len)
+{
+	Segment seg;
+	seg.len = chunk_header(&client->out_chunks[channel_num & 0x3f],
+			       seg.header, channel_num, type, endpoint, len,
+			       timestamp);
+	push_segment(client, seg);
+}
+
+/* Queues the chunked message body after a header built for this client */
+void queue_chunked(Client *client, int channel_num, uint8_t type,
+		   uint32_t endpoint, unsigned long timestamp, size_t len,
+		   const shared_buf_t &body)
+{
+	queue_header(client, channel_num, type, endpoint, timestamp, len);
+	queue_send(client, body);
+}
+
+/*
+ * Queues an FLV tag for an HTTP-FLV viewer. The tag header and the size
+ * trailing the tag are built for this client, the data is shared.
+ */
+void queue_tag(Client *client, uint8_t type, unsigned long timestamp,
+	       const shared_buf_t &data)
+{
+	Segment header;
+	flv_write_tag_header(header.header, type, timestamp, data->size());
+	header.len = FLV_TAG_HEADER;
+	push_segment(client, header);
 
-	RTMP_Header header;
-	header.flags = (channel_num & 0x3f) | (0 << 6);
-	header.msg_type = type;
-	set_be24(header.timestamp, timestamp);
-	set_be24(header.msg_len, buf.size());
-	set_le32(header.endpoint, endpoint);
+	queue_send(client, data);
+
+	Segment trailer;
+	flv_write_tag_size(trailer.header, data->size());
+	trailer.len = FLV_TAG_SIZE;
+	push_segment(client, trailer);
+}
+
+/*
+ * Queues a message of the stream, framed for the client: the body is
+ * chunked for RTMP clients and the raw payload for HTTP-FLV viewers.
+ */
+void queue_message(Client *client, uint8_t type, unsigned long timestamp,
+		   size_t len, const shared_buf_t &body)
+{
+	if (client->kind == CLIENT_HTTP) {
+		queue_tag(client, type, timestamp, body);
+	} else {
+		queue_chunked(client, CHAN_STREAM, type, client->stream_id,
+			      timestamp, len, body);
+	}
+}
 
-	client->send_queue.append((char *) &header, sizeof header);
-	client->written_seq += sizeof header;
+/*
+ * Queues a media message whose body stays in memory kept alive by the
+ * owner, such as a mapped file. The chunks point straight into it, only
+ * the chunk headers are built.
+ */
+void queue_mapped(Client *client, const std::shared_ptr<const void> &owner,
+		  uint8_t type, unsigned long timestamp, const char *data,
+		  size_t len)
+{
+	queue_header(client, CHAN_STREAM, type, client->stream_id, timestamp,
+		     len);
 
 	size_t pos = 0;
-	while (pos < buf.size()) {
+	while (pos < len) {
 		if (pos) {
-			uint8_t flags = (channel_num & 0x3f) | (3 << 6);
-			client->send_queue += char(flags);
-
-			client->written_seq += 1;
+			Segment cont;
+			cont.header[0] = (CHAN_STREAM & 0x3f) | (3 << 6);
+			cont.len = 1;
+			push_segment(client, cont);
 		}
+		Segment seg;
+		seg.owner = owner;
+		seg.base = data;
+		seg.pos = pos;
+		seg.len = std::min(len - pos, client->out_chunk_len);
+		push_segment(client, seg);
+		pos += seg.len;
+	}
 
-		size_t chunk = buf.size() - pos;
-		if (chunk > client->chunk_len)
-			chunk = client->chunk_len;
-		client->send_queue.append(buf, pos, chunk);
+	Segment &seg = client->send_queue.back();
+	seg.media_end = true;
+	seg.timestamp = timestamp;
+	client->queued_ts = timestamp;
+}
 
-		client->written_seq += chunk;
-		pos += chunk;
+/* The fan-out time is given for live messages, to measure the latency */
+void queue_media(Client *client, const shared_buf_t &body,
+		 const StreamEvent &event, uint64_t fanout_time)
+{
+	queue_message(client, event.type, event.timestamp, event.buf->size(),
+		      body);
+
+	Segment &seg = client->send_queue.back();
+	seg.media_end = true;
+	seg.timestamp = event.timestamp;
+	if (fanout_time) {
+		seg.recv_time = event.recv_time;
+		seg.queue_time = fanout_time;
+		seg.traced = event.traced;
 	}
+	client->queued_ts = event.timestamp;
+}
 
-	try_to_send(client);
+/*
+ * Bytes written to the socket but not yet acknowledged by the peer, beyond
+ * the two windows a healthy peer may have outstanding. Zero if the peer
+ * does not send acknowledgements.
+ */
+size_t ack_lag(const Client *client)
+{
+	if (!client->acks_seen)
+		return 0;
+	int32_t in_flight = client->written_seq - client->queued -
+			    client->read_seq;
+	if (in_flight <= 2 * DEFAULT_WINDOW)
+		return 0;
+	return in_flight - 2 * DEFAULT_WINDOW;
 }
 
-void send_reply(Client *client, double txid, const AMFValue &reply = AMFValue(),
-		const AMFValue &status = AMFValue())
+/*
+ * How far behind a viewer is: 0 if fine, 1 if over the queue limits and 2
+ * if over twice the limits.
+ */
+int congestion(const Client *client)
 {
-	if (txid <= 0.0)
-		return;
-	Encoder invoke;
-	amf_write(&invoke, std::string("_result"));
-	amf_write(&invoke, txid);
-	amf_write(&invoke, reply);
-	amf_write(&invoke, status);
-	rtmp_send(client, MSG_INVOKE, CONTROL_ID, invoke.buf, 0, CHAN_RESULT);
+	long duration = client->queued_ts - client->sent_ts;
+	if (duration < 0) {
+		/* timestamps restarted */
+		duration = 0;
+	}
+	/* data stuck in the network counts as queued, the GOP burst does not */
+	size_t backlog = client->queued - client->burst_left + ack_lag(client);
+	if (backlog > max_queue_len * 2 ||
+	    (unsigned long) duration > max_queue_time * 2)
+		return 2;
+	if (backlog > max_queue_len ||
+	    (unsigned long) duration > max_queue_time)
+		return 1;
+	return 0;
 }
 
-void handle_connect(Client *client, double txid, Decoder *dec)
+void rtmp_send(Client *client, uint8_t type, uint32_t endpoint,
+		const std::string &buf, unsigned long timestamp = 0,
+		int channel_num = CHAN_CONTROL)
 {
-	amf_object_t params = amf_load_object(dec);
-	std::string app = get(params, std::string("app")).as_string();
-	std::string ver = "(unknown)";
-	AMFValue flashver = get(params, std::string("flashVer"));
-	if (flashver.type() == AMF_STRING) {
-		ver = flashver.as_string();
+	if (endpoint == STREAM_ID) {
+		/*
+		 * For some unknown reason, stream-related msgs must be sent
+		 * on a specific channel.
+		 */
+		channel_num = CHAN_STREAM;
 	}
+	std::string body = chunk_body(buf, channel_num, client->out_chunk_len);
+	queue_chunked(client, channel_num, type, endpoint, timestamp,
+		      buf.size(), pool_share(body));
+}
 
-	if (app != APP_NAME) {
-		throw std::runtime_error("Unsupported application: " + app);
+/*
+ * A media message relayed to many clients. The chunked body is built only
+ * once for each distinct chunk size, and the same buffer is queued to every
+ * client using that chunk size. Only the first chunk header is per client.
+ * HTTP-FLV viewers share the payload as received from the publisher.
+ */
+class SharedMessage {
+public:
+	SharedMessage(const StreamEvent &event) :
+		m_event(event)
+	{
 	}
 
-	printf("connect: %s (version %s)\n", app.c_str(), ver.c_str());
+	const StreamEvent &event() const { return m_event; }
+
+	/* fanout_time is given when relaying live, and 0 for a cached message */
+	void send(Client *client, uint64_t fanout_time = 0)
+	{
+		queue_media(client, body(client), m_event, fanout_time);
+	}
 
-	amf_object_t version;
-	version.insert(std::make_pair("fmsVer", std::string("FMS/4,5,1,484")));
-	version.insert(std::make_pair("capabilities", 255.0));
-	version.insert(std::make_pair("mode", 1.0));
+	/* Sends a message that does not count as media, such as metadata */
+	void send_control(Client *client)
+	{
+		queue_message(client, m_event.type, m_event.timestamp,
+			      m_event.buf->size(), body(client));
+	}
 
-	amf_object_t status;
-	status.insert(std::make_pair("level", std::string("status")));
-	status.insert(std::make_pair("code", std::string("NetConnection.Connect.Success")));
-	status.insert(std::make_pair("description", std::string("Connection succeeded.")));
-	/* report support for AMF3 */
-	status.insert(std::make_pair("objectEncoding", 3.0));
+private:
+	typedef std::vector<std::pair<size_t, shared_buf_t> > chunked_list_t;
 
-	send_reply(client, txid, version, status);
+	StreamEvent m_event;
+	chunked_list_t m_chunked;
 
-/*
-	uint32_t chunk_len = htonl(1024);
-	std::string set_chunk((char *) &chunk_len, 4);
-	rtmp_send(client, MSG_SET_CHUNK, CONTROL_ID, set_chunk, 0,
-		  MEDIA_CHANNEL);
+	shared_buf_t body(const Client *client)
+	{
+		if (client->kind == CLIENT_HTTP)
+			return m_event.buf;
+		return chunked(client->out_chunk_len);
+	}
+
+	shared_buf_t chunked(size_t chunk_len)
+	{
+		FOR_EACH(chunked_list_t, i, m_chunked) {
+			if (i->first == chunk_len)
+				return i->second;
+		}
+		std::string buf = chunk_body(*m_event.buf, CHAN_STREAM,
+					     chunk_len);
+		shared_buf_t data = pool_share(buf);
+		m_chunked.push_back(std::make_pair(chunk_len, data));
+		return data;
+	}
+};
 
-	client->chunk_len = 1024;
-*/
+bool is_sequence_header(const StreamEvent *event)
+{
+	return flv_is_sequence_header(event->type, event->buf->data(),
+				      event->buf->size());
 }
 
-void handle_fcpublish(Client *client, double txid, Decoder *dec)
+bool is_keyframe(const StreamEvent *event)
 {
-	if (publisher != NULL) {
-		throw std::runtime_error("Already have a publisher");
-	}
-	publisher = client;
-	printf("publisher connected.\n");
+	return flv_is_keyframe(event->type, event->buf->data(),
+			       event->buf->size());
+}
 
-	amf_load(dec); /* NULL */
+/*
+ * Decides if a media message should be queued to a viewer. When the viewer
+ * falls behind, inter frames are dropped until the next keyframe. If the
+ * queue still keeps growing, everything is dropped until a keyframe finds
+ * the queue within the limits again. Messages are only dropped whole.
+ */
+bool accept_media(Client *client, const StreamEvent *event)
+{
+	int level = congestion(client);
+	if (level >= 2) {
+		client->ready = false;
+		client->dropped++;
+		client->worker->dropped++;
+		return false;
+	}
+	if (event->type == MSG_VIDEO && !is_sequence_header(event)) {
+		if (is_keyframe(event)) {
+			client->skip_video = false;
+		} else if (level > 0 || client->skip_video) {
+			client->skip_video = true;
+			client->dropped++;
+			client->worker->dropped++;
+			return false;
+		}
+	}
+	return true;
+}
 
-	std::string path = amf_load_string(dec);
-	debug("fcpublish %s\n", path.c_str());
+/* Keeps the messages new viewers need to start decoding right away */
+void cache_message(LocalStream *local, const shared_msg_t &shared)
+{
+	const StreamEvent *event = &shared->event();
+	if (is_sequence_header(event)) {
+		if (event->type == MSG_VIDEO) {
+			local->video_header = shared;
+		} else {
+			local->audio_header = shared;
+		}
+		return;
+	}
 
-	amf_object_t status;
-	status.insert(std::make_pair("code", std::string("NetStream.Publish.Start")));
-	status.insert(std::make_pair("description", path));
+	if (is_keyframe(event)) {
+		local->gop.clear();
+		local->gop_bytes = 0;
+	} else if (local->gop.empty()) {
+		/* wait for a keyframe */
+		return;
+	}
 
-	Encoder invoke;
-	amf_write(&invoke, std::string("onFCPublish"));
-	amf_write(&invoke, 0.0);
-	amf_write_null(&invoke);
-	amf_write(&invoke, status);
-	rtmp_send(client, MSG_INVOKE, CONTROL_ID, invoke.buf);
+	local->gop_bytes += event->buf->size();
+	if (local->gop_bytes > gop_cache_len) {
+		/* too long GOP, new viewers have to wait for a keyframe */
+		local->gop.clear();
+		local->gop_bytes = 0;
+		return;
+	}
+	local->gop.push_back(shared);
+}
 
-	send_reply(client, txid);
+void clear_cache(LocalStream *local)
+{
+	local->metadata.reset();
+	local->push_metadata.reset();
+	local->video_header.reset();
+	local->audio_header.reset();
+	local->gop.clear();
+	local->gop_bytes = 0;
 }
 
-void handle_createstream(Client *client, double txid, Decoder *dec)
+LocalStream *local_stream(Client *client)
 {
-	send_reply(client, txid, AMFValue(), double(STREAM_ID));
+	return &client->stream->local[client->worker->id];
 }
 
-void handle_publish(Client *client, double txid, Decoder *dec)
+void send_clear_stream(Client *client)
 {
-	amf_load(dec); /* NULL */
+	std::string control;
+	uint16_t type = htons(CONTROL_CLEAR_STREAM);
+	control.append((char *) &type, 2);
+	uint32_t stream = htonl(STREAM_ID);
+	control.append((char *) &stream, 4);
+	rtmp_send(client, MSG_USER_CONTROL, CONTROL_ID, control);
+}
 
-	std::string path = amf_load_string(dec);
-	debug("publish %s\n", path.c_str());
+/*
+ * Begins relaying media to a viewer from the message with the timestamp,
+ * starting with the sequence headers
+ */
+void start_stream(Client *client, unsigned long timestamp)
+{
+	if (client->kind == CLIENT_RTMP) {
+		send_clear_stream(client);
+	}
 
-	amf_object_t status;
-	status.insert(std::make_pair("level", std::string("status")));
-	status.insert(std::make_pair("code", std::string("NetStream.Publish.Start")));
-	status.insert(std::make_pair("description", std::string("Stream is now published.")));
-	status.insert(std::make_pair("details", path));
+	/*
+	 * The queue is measured from here, not from whatever was sent before.
+	 * The sequence headers keep their old timestamps, so they do not
+	 * count as media.
+	 */
+	client->queued_ts = timestamp;
+	client->sent_ts = timestamp;
+
+	LocalStream *local = local_stream(client);
+	if (local->video_header) {
+		local->video_header->send_control(client);
+	}
+	if (local->audio_header) {
+		local->audio_header->send_control(client);
+	}
+	client->ready = true;
+}
 
-	Encoder invoke;
-	amf_write(&invoke, std::string("onStatus"));
-	amf_write(&invoke, 0.0);
-	amf_write_null(&invoke);
-	amf_write(&invoke, status);
-	rtmp_send(client, MSG_INVOKE, STREAM_ID, invoke.buf);
+std::string stream_name(const Client *client, std::string_view path)
+{
+	/* query parameters do not select a different stream */
+	std::string name = client->app + "/";
+	name += path.substr(0, path.find('?'));
+	return name;
+}
 
-	send_reply(client, txid);
+/* Finds a stream from the registry, or adds it. Must hold registry_lock. */
+std::shared_ptr<Stream> find_stream(const std::string &name)
+{
+	registry_t::iterator i = streams.find(name);
+	if (i != streams.end())
+		return i->second;
+
+	std::shared_ptr<Stream> stream = std::make_shared<Stream>();
+	stream->name = name;
+	stream->publisher = NULL;
+	stream->viewers = 0;
+	stream->pushes = 0;
+	stream->local.resize(workers.size());
+	streams.insert(std::make_pair(name, stream));
+	return stream;
 }
 
-void start_playback(Client *client)
+/* Drops a stream from the registry once unused. Must hold registry_lock. */
+void release_stream(const std::shared_ptr<Stream> &stream)
 {
-	amf_object_t status;
-	status.insert(std::make_pair("level", std::string("status")));
-	status.insert(std::make_pair("code", std::string("NetStream.Play.Reset")));
-	status.insert(std::make_pair("description", std::string("Resetting and playing stream.")));
-
-	Encoder invoke;
-	amf_write(&invoke, std::string("onStatus"));
-	amf_write(&invoke, 0.0);
-	amf_write_null(&invoke);
-	amf_write(&invoke, status);
-	rtmp_send(client, MSG_INVOKE, STREAM_ID, invoke.buf);
-
-	status.clear();
-	status.insert(std::make_pair("level", std::string("status")));
-	status.insert(std::make_pair("code", std::string("NetStream.Play.Start")));
-	status.insert(std::make_pair("description", std::string("Started playing.")));
-
-	invoke.buf.clear();
-	amf_write(&invoke, std::string("onStatus"));
-	amf_write(&invoke, 0.0);
-	amf_write_null(&invoke);
-	amf_write(&invoke, status);
-	rtmp_send(client, MSG_INVOKE, STREAM_ID, invoke.buf);
-
-	invoke.buf.clear();
-	amf_write(&invoke, std::string("|RtmpSampleAccess"));
-	amf_write(&invoke, true);
-	amf_write(&invoke, true);
-	rtmp_send(client, MSG_NOTIFY, STREAM_ID, invoke.buf);
+	if (stream->publisher == NULL && stream->viewers == 0 &&
+	    stream->pushes == 0) {
+		streams.erase(stream->name);
+	}
+}
 
-	client->playing = true;
-	client->ready = false;
+void unsubscribe(Client *client)
+{
+	if (!client->stream || client->publishing)
+		return;
 
-	if (publisher != NULL) {
-		Encoder notify;
-		amf_write(&notify, std::string("onMetaData"));
-		amf_write_ecma(&notify, metadata);
-		rtmp_send(client, MSG_NOTIFY, STREAM_ID, notify.buf);
+	/* move the last subscriber in place of the removed one */
+	LocalStream *local = local_stream(client);
+	Client *last = local->subscribers.back();
+	local->subscribers[client->stream_index] = last;
+	last->stream_index = client->stream_index;
+	local->subscribers.pop_back();
+
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		if (client->kind == CLIENT_PUSH) {
+			client->stream->pushes--;
+		} else {
+			client->stream->viewers--;
+		}
+		release_stream(client->stream);
 	}
+	client->stream.reset();
+	client->playing = false;
+	client->ready = false;
 }
 
-void handle_play(Client *client, double txid, Decoder *dec)
+void subscribe(Client *client, const std::string &name)
 {
-	amf_load(dec); /* NULL */
-
-	std::string path = amf_load_string(dec);
+	if (client->publishing) {
+		throw std::runtime_error("publisher can not play");
+	}
+	unsubscribe(client);
+
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		client->stream = find_stream(name);
+		if (client->kind == CLIENT_PUSH) {
+			client->stream->pushes++;
+		} else {
+			client->stream->viewers++;
+		}
+	}
 
-	debug("play %s\n", path.c_str());
+	LocalStream *local = local_stream(client);
+	client->stream_index = local->subscribers.size();
+	local->subscribers.push_back(client);
+}
 
-	start_playback(client);
+void send_reply(Client *client, double txid,
+		const Template &reply = templates.result)
+{
+	if (txid <= 0.0)
+		return;
+	rtmp_send(client, MSG_INVOKE, CONTROL_ID, reply.fill(txid), 0,
+		  CHAN_RESULT);
+}
 
-	send_reply(client, txid);
+/* Larger chunks mean fewer headers to write and parse */
+void send_chunk_len(Client *client)
+{
+	uint32_t chunk_len = htonl(out_chunk_len);
+	std::string set_chunk((char *) &chunk_len, 4);
+	rtmp_send(client, MSG_SET_CHUNK, CONTROL_ID, set_chunk);
+	client->out_chunk_len = out_chunk_len;
 }
 
-void handle_play2(Client *client, double txid, Decoder *dec)
+void handle_connect(Client *client, double txid, Decoder *dec)
 {
-	amf_load(dec); /* NULL */
+	AMFValue params = amf_load_object(dec);
+	AMFValue app = params.get("app");
+	if (app.type() != AMF_STRING) {
+		throw std::runtime_error("connect without an app");
+	}
+	std::string_view ver = "(unknown)";
+	AMFValue flashver = params.get("flashVer");
+	if (flashver.type() == AMF_STRING) {
+		ver = flashver.as_string();
+	}
 
-	amf_object_t params = amf_load_object(dec);
-	std::string path = get(params, std::string("streamName")).as_string();
+	client->app = app.as_string();
 
-	debug("play %s\n", path.c_str());
+	printf("connect: %s (version %.*s)\n", client->app.c_str(),
+	       int(ver.size()), ver.data());
 
-	start_playback(client);
+	uint32_t window = htonl(DEFAULT_WINDOW);
+	std::string ack_size((char *) &window, 4);
+	rtmp_send(client, MSG_WINDOW_ACK_SIZE, CONTROL_ID, ack_size);
 
-	send_reply(client, txid);
+	std::string peer_bw = ack_size + char(PEER_BW_DYNAMIC);
+	rtmp_send(client, MSG_SET_PEER_BW, CONTROL_ID, peer_bw);
+
+	send_chunk_len(client);
+
+	send_reply(client, txid, templates.connect_result);
 }
 
-void handle_pause(Client *client, double txid, Decoder *dec)
+void handle_fcpublish(Client *client, double txid, Decoder *dec)
 {
 	amf_load(dec); /* NULL */
 
-	bool paused = amf_load_boolean(dec);
-
-	if (paused) {
-		debug("pausing\n");
+	std::string_view path = amf_load_string_view(dec);
+	debug("fcpublish %.*s\n", int(path.size()), path.data());
 
-		amf_object_t status;
-		status.insert(std::make_pair("level", std::string("status")));
-		status.insert(std::make_pair("code", std::string("NetStream.Pause.Notify")));
-		status.insert(std::make_pair("description", std::string("Pausing.")));
-
-		Encoder invoke;
-		amf_write(&invoke, std::string("onStatus"));
-		amf_write(&invoke, 0.0);
-		amf_write_null(&invoke);
-		amf_write(&invoke, status);
-		rtmp_send(client, MSG_INVOKE, STREAM_ID, invoke.buf);
-		client->playing = false;
-	} else {
-		start_playback(client);
-	}
+	rtmp_send(client, MSG_INVOKE, CONTROL_ID,
+		  templates.fcpublish_status.fill(path));
 
 	send_reply(client, txid);
 }
 
+void handle_createstream(Client *client, double txid, Decoder *dec)
+{
+	send_reply(client, txid, templates.createstream_result);
+}
+
+void pull_stream(Worker *worker, const std::shared_ptr<Stream> &stream);
+void push_stream(Worker *worker, const std::shared_ptr<Stream> &stream);
+void stop_pushes(Worker *worker, const std::shared_ptr<Stream> &stream);
+
+void handle_publish(Client *client, double txid, Decoder *dec)
+{
+	amf_load(dec); /* NULL */
+
+	std::string_view path = amf_load_string_view(dec);
+	debug("publish %.*s\n", int(path.size()), path.data());
+
+	if (client->stream) {
+		throw std::runtime_error("already playing or publishing");
+	}
+	std::string name = stream_name(client, path);
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		std::shared_ptr<Stream> stream = find_stream(name);
+		if (stream->publisher != NULL) {
+			throw std::runtime_error("already published: " + name);
+		}
+		stream->publisher = client;
+		client->stream = stream;
+	}
+	client->publishing = true;
+	client->rate_start = 0;
+	client->rate_bytes = 0;
+	client->rate_frames = 0;
+	client->ingest_bitrate = 0;
+	client->ingest_fps = 0;
+	client->keyframe_seen = false;
+	client->keyframe_interval = 0;
+	/* only a publisher may send large messages */
+	client->parser.max_message = max_message_len;
+	printf("publishing %s\n", name.c_str());
+	if (recorder) {
+		client->recording = recorder->open(name);
+	}
+
+	rtmp_send(client, MSG_INVOKE, STREAM_ID,
+		  templates.publish_status.fill(path));
+
+	if (!push_targets.empty()) {
+		push_stream(client->worker, client->stream);
+	}
+
+	send_reply(client, txid);
+}
+
+void send_play_status(Client *client)
+{
+	rtmp_send(client, MSG_INVOKE, STREAM_ID, templates.play_reset);
+	rtmp_send(client, MSG_INVOKE, STREAM_ID, templates.play_start);
+	rtmp_send(client, MSG_NOTIFY, STREAM_ID, templates.sample_access);
+}
+
+/*
+ * Sends the metadata of the stream. A push target gets it the way a
+ * publisher sends it, wrapped in @setDataFrame.
+ */
+void send_metadata(Client *client)
+{
+	LocalStream *local = local_stream(client);
+	if (!local->metadata)
+		return;
+	if (client->kind != CLIENT_PUSH) {
+		local->metadata->send_control(client);
+		return;
+	}
+	if (!local->push_metadata) {
+		StreamEvent event = local->metadata->event();
+		Encoder enc;
+		amf_write(&enc, "@setDataFrame");
+		enc.buf += *event.buf;
+		event.buf = std::make_shared<const std::string>(enc.buf);
+		local->push_metadata = std::make_shared<SharedMessage>(event);
+	}
+	local->push_metadata->send_control(client);
+}
+
+/* Starts relaying the stream to a subscriber, from the current GOP */
+void join_stream(Client *client)
+{
+	client->playing = true;
+	client->ready = false;
+
+	send_metadata(client);
+
+	/* burst the current GOP so that playback can start immediately */
+	LocalStream *local = local_stream(client);
+	if (!local->gop.empty()) {
+		start_stream(client, local->gop.front()->event().timestamp);
+		FOR_EACH(std::vector<shared_msg_t>, i, local->gop) {
+			(*i)->send(client);
+		}
+		/* the queue is sent in order, so the burst goes out first */
+		client->burst_left = client->queued;
+	}
+}
+
+void start_playback(Client *client)
+{
+	send_play_status(client);
+	join_stream(client);
+}
+
+/* Restarts the playback clock of a file from the tag at the offset */
+void rewind_vod(Client *client, size_t offset, unsigned long timestamp)
+{
+	client->vod_pos = offset;
+	client->vod_ts = timestamp;
+	client->vod_clock = now_ms();
+}
+
+void stop_vod(Client *client)
+{
+	if (!client->vod)
+		return;
+
+	/* move the last client in place of the removed one */
+	Worker *worker = client->worker;
+	Client *last = worker->vod_clients.back();
+	worker->vod_clients[client->vod_index] = last;
+	last->vod_index = client->vod_index;
+	worker->vod_clients.pop_back();
+
+	client->vod.reset();
+	client->playing = false;
+}
+
+void start_vod(Client *client, const std::shared_ptr<VodFile> &file)
+{
+	send_play_status(client);
+	send_clear_stream(client);
+
+	client->vod = file;
+	client->vod_index = client->worker->vod_clients.size();
+	client->worker->vod_clients.push_back(client);
+	rewind_vod(client, file->first_tag(), 0);
+	client->playing = true;
+}
+
+/* Queues the tags of the files being played as their time comes */
+void pump_vod(Worker *worker)
+{
+	uint64_t now = now_ms();
+	FOR_EACH(std::vector<Client *>, i, worker->vod_clients) {
+		Client *client = *i;
+		if (!client->playing)
+			continue;
+		if (client->queued >= VOD_QUEUE_LEN)
+			continue;
+		if (client->vod->truncated()) {
+			printf("file truncated while playing\n");
+			rtmp_send(client, MSG_INVOKE, STREAM_ID,
+				  templates.play_stop);
+			client->playing = false;
+			continue;
+		}
+		unsigned long clock = client->vod_ts + VOD_BUFFER +
+				      (now - client->vod_clock);
+		while (client->queued < VOD_QUEUE_LEN) {
+			FlvTag tag;
+			if (!client->vod->tag(client->vod_pos, &tag)) {
+				debug("end of file\n");
+				rtmp_send(client, MSG_INVOKE, STREAM_ID,
+					  templates.play_stop);
+				client->playing = false;
+				break;
+			}
+			if (tag.timestamp > clock)
+				break;
+			if (tag.type == MSG_AUDIO || tag.type == MSG_VIDEO ||
+			    tag.type == MSG_NOTIFY) {
+				queue_mapped(client, client->vod, tag.type,
+					     tag.timestamp, tag.data, tag.len);
+			}
+			client->vod_pos = tag.next;
+		}
+	}
+}
+
+/* The file for a play path: "<dir>/<app>/<path>.flv", or NULL */
+std::shared_ptr<VodFile> find_vod(const Client *client, std::string_view path)
+{
+	if (vod_dir == NULL)
+		return std::shared_ptr<VodFile>();
+	if (path.substr(0, 4) == "flv:") {
+		path.remove_prefix(4);
+	}
+	std::string name = stream_name(client, path);
+	if (name.find("..") != std::string::npos) {
+		throw std::runtime_error("invalid file name: " + name);
+	}
+	if (name.size() < 4 || name.compare(name.size() - 4, 4, ".flv") != 0) {
+		name += ".flv";
+	}
+	return open_vod(std::string(vod_dir) + "/" + name);
+}
+
+/* Subscribes to a live stream, pulling it from the origin in edge mode */
+void watch_stream(Client *client, const std::string &name)
+{
+	subscribe(client, name);
+	if (!origin.host.empty()) {
+		pull_stream(client->worker, client->stream);
+	}
+}
+
+/* Plays a file if there is one with the name, otherwise the live stream */
+void play(Client *client, std::string_view path)
+{
+	if (client->publishing) {
+		throw std::runtime_error("publisher can not play");
+	}
+	std::shared_ptr<VodFile> file = find_vod(client, path);
+	stop_vod(client);
+	if (file) {
+		unsubscribe(client);
+		start_vod(client, file);
+	} else {
+		watch_stream(client, stream_name(client, path));
+		start_playback(client);
+	}
+}
+
+void handle_play(Client *client, double txid, Decoder *dec)
+{
+	amf_load(dec); /* NULL */
+
+	std::string_view path = amf_load_string_view(dec);
+
+	debug("play %.*s\n", int(path.size()), path.data());
+
+	play(client, path);
+
+	send_reply(client, txid);
+}
+
+void handle_play2(Client *client, double txid, Decoder *dec)
+{
+	amf_load(dec); /* NULL */
+
+	AMFValue params = amf_load_object(dec);
+	AMFValue path = params.get("streamName");
+	if (path.type() != AMF_STRING) {
+		throw std::runtime_error("play2 without a stream name");
+	}
+
+	debug("play %.*s\n", int(path.as_string().size()),
+	      path.as_string().data());
+
+	play(client, path.as_string());
+
+	send_reply(client, txid);
+}
+
+void handle_pause(Client *client, double txid, Decoder *dec)
+{
+	amf_load(dec); /* NULL */
+
+	bool paused = amf_load_boolean(dec);
+
+	if ((!client->stream && !client->vod) || client->publishing) {
+		throw std::runtime_error("not playing");
+	}
+
+	if (paused) {
+		debug("pausing\n");
+
+		rtmp_send(client, MSG_INVOKE, STREAM_ID, templates.pause_notify);
+		client->playing = false;
+		client->ready = false;
+	} else if (client->vod) {
+		if (client->vod->truncated()) {
+			throw std::runtime_error("file truncated while playing");
+		}
+		/* continue from where the file was left */
+		FlvTag tag;
+		if (client->vod->tag(client->vod_pos, &tag)) {
+			rewind_vod(client, client->vod_pos, tag.timestamp);
+		}
+		send_play_status(client);
+		client->playing = true;
+	} else {
+		start_playback(client);
+	}
+
+	send_reply(client, txid);
+}
+
+void handle_seek(Client *client, double txid, Decoder *dec)
+{
+	amf_load(dec); /* NULL */
+
+	double offset = amf_load_number(dec);
+
+	if (!client->vod) {
+		throw std::runtime_error("can only seek in a file");
+	}
+	if (client->vod->truncated()) {
+		throw std::runtime_error("file truncated while playing");
+	}
+	debug("seek %.0f\n", offset);
+
+	const KeyFrame &key = client->vod->seek(offset > 0 ? offset : 0);
+	send_clear_stream(client);
+	rtmp_send(client, MSG_INVOKE, STREAM_ID, templates.seek_notify);
+	rtmp_send(client, MSG_INVOKE, STREAM_ID, templates.play_start);
+
+	/* the decoder needs the sequence headers before the keyframe */
+	const std::vector<size_t> &headers = client->vod->headers();
+	FOR_EACH_CONST(std::vector<size_t>, i, headers) {
+		FlvTag tag;
+		if (client->vod->tag(*i, &tag)) {
+			queue_mapped(client, client->vod, tag.type,
+				     key.timestamp, tag.data, tag.len);
+		}
+	}
+	rewind_vod(client, key.offset, key.timestamp);
+	client->playing = true;
+
+	send_reply(client, txid);
+}
+
+void handle_stream_event(Worker *worker, const StreamEvent *event)
+{
+	LocalStream *local = &event->stream->local[worker->id];
+
+	switch (event->type) {
+	case MSG_NOTIFY:
+		local->metadata = std::make_shared<SharedMessage>(*event);
+		local->push_metadata.reset();
+		FOR_EACH(std::vector<Client *>, i, local->subscribers) {
+			Client *client = *i;
+			if (client->playing) {
+				send_metadata(client);
+			}
+		}
+		break;
+
+	case MSG_AUDIO:
+	case MSG_VIDEO: {
+		shared_msg_t shared = std::make_shared<SharedMessage>(*event);
+		cache_message(local, shared);
+
+		uint64_t now = 0;
+		if (event->recv_time && !local->subscribers.empty()) {
+			now = now_us();
+			local->latency.observe(STAGE_INGEST,
+					       now - event->recv_time);
+		}
+
+		bool start = is_keyframe(event) && !is_sequence_header(event);
+		FOR_EACH(std::vector<Client *>, i, local->subscribers) {
+			Client *receiver = *i;
+			if (receiver->playing && !receiver->ready && start &&
+			    congestion(receiver) == 0) {
+				start_stream(receiver, event->timestamp);
+			}
+			if (receiver->ready && accept_media(receiver, event)) {
+				shared->send(receiver, now);
+			}
+		}
+		}
+		break;
+
+	case EVENT_GAP:
+		/* the GOP misses frames, and so do the viewers */
+		local->gop.clear();
+		local->gop_bytes = 0;
+		FOR_EACH(std::vector<Client *>, i, local->subscribers) {
+			Client *client = *i;
+			client->skip_video = true;
+		}
+		break;
+
+	case 0:
+		clear_cache(local);
+		FOR_EACH(std::vector<Client *>, i, local->subscribers) {
+			Client *client = *i;
+			client->ready = false;
+		}
+		break;
+	}
+}
+
+/*
+ * Relays a published event to the clients of every worker. Other workers
+ * get it through their inbox, and are woken up after this iteration.
+ */
+void publish_event(Worker *worker, const StreamEvent &event)
+{
+	FOR_EACH(std::vector<Worker *>, i, workers) {
+		Worker *target = *i;
+		if (target == worker) {
+			handle_stream_event(worker, &event);
+			continue;
+		}
+		std::deque<StreamEvent> &backlog = worker->backlog[target->id];
+		if (backlog.empty() && target->inbox[worker->id]->push(event)) {
+			worker->wake_pending[target->id] = true;
+		} else if ((event.type == MSG_AUDIO || event.type == MSG_VIDEO) &&
+			   !is_sequence_header(&event)) {
+			debug("worker %zu inbox full, event dropped\n",
+			      target->id);
+			worker->dropped++;
+			if (backlog.empty() || backlog.back().type != EVENT_GAP ||
+			    backlog.back().stream != event.stream) {
+				StreamEvent gap = event;
+				gap.type = EVENT_GAP;
+				gap.buf.reset();
+				gap.recv_time = 0;
+				gap.traced = false;
+				backlog.push_back(gap);
+			}
+		} else {
+			/* metadata, sequence headers and the end of stream */
+			backlog.push_back(event);
+		}
+	}
+}
+
+/* Hands the held back events over, in order, as the inboxes drain */
+void flush_backlog(Worker *worker)
+{
+	for (size_t i = 0; i < workers.size(); ++i) {
+		std::deque<StreamEvent> &backlog = worker->backlog[i];
+		while (!backlog.empty() &&
+		       workers[i]->inbox[worker->id]->push(backlog.front())) {
+			backlog.pop_front();
+			worker->wake_pending[i] = true;
+		}
+	}
+}
+
+/* Updates the ingest rates of a publisher, for the metrics */
+void count_ingest(Client *client, const StreamEvent &event)
+{
+	client->rate_bytes += event.buf->size();
+	if (event.type == MSG_VIDEO && !is_sequence_header(&event)) {
+		client->rate_frames++;
+		if (is_keyframe(&event)) {
+			if (client->keyframe_seen) {
+				client->keyframe_interval =
+					event.timestamp - client->keyframe_ts;
+			}
+			client->keyframe_seen = true;
+			client->keyframe_ts = event.timestamp;
+		}
+	}
+	long elapsed = event.timestamp - client->rate_start;
+	if (elapsed < 0) {
+		/* timestamps restarted */
+		client->rate_start = event.timestamp;
+		client->rate_bytes = 0;
+		client->rate_frames = 0;
+	} else if (elapsed >= RATE_WINDOW) {
+		client->ingest_bitrate = client->rate_bytes * 8000.0 / elapsed;
+		client->ingest_fps = client->rate_frames * 1000.0 / elapsed;
+		client->rate_start = event.timestamp;
+		client->rate_bytes = 0;
+		client->rate_frames = 0;
+	}
+}
+
+/* Relays a message from the publisher, and records it */
+void publish_message(Client *client, const StreamEvent &event)
+{
+	if (event.type != MSG_NOTIFY) {
+		count_ingest(client, event);
+	}
+	if (client->recording) {
+		recorder->write(client->recording, event.type, event.timestamp,
+				event.buf);
+	}
+	publish_event(client->worker, event);
+}
+
+void stop_publishing(Client *client)
+{
+	printf("unpublishing %s\n", client->stream->name.c_str());
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		client->stream->publisher = NULL;
+		release_stream(client->stream);
+	}
+	stop_pushes(client->worker, client->stream);
+
+	StreamEvent event;
+	event.stream = client->stream;
+	event.type = 0;
+	event.timestamp = 0;
+	event.recv_time = 0;
+	event.traced = false;
+	publish_event(client->worker, event);
+
+	if (client->recording) {
+		recorder->close(client->recording);
+		client->recording.reset();
+	}
+	client->stream.reset();
+	client->publishing = false;
+	client->parser.max_message = MAX_CONTROL_MESSAGE;
+}
+
+/* Relays an onMetaData notify to the viewers */
+void publish_metadata(Client *client, const std::string &notify)
+{
+	StreamEvent event;
+	event.stream = client->stream;
+	event.type = MSG_NOTIFY;
+	event.timestamp = 0;
+	event.buf = std::make_shared<const std::string>(notify);
+	event.recv_time = 0;
+	event.traced = false;
+	publish_message(client, event);
+}
+
 void handle_setdataframe(Client *client, Decoder *dec)
 {
-	if (client != publisher) {
+	if (!client->publishing) {
 		throw std::runtime_error("not a publisher");
 	}
 
-	std::string type = amf_load_string(dec);
+	std::string_view type = amf_load_string_view(dec);
 	if (type != "onMetaData") {
 		throw std::runtime_error("can only set metadata");
 	}
 
-	metadata = amf_load_ecma(dec);
+	AMFValue metadata = amf_load_ecma(dec);
 
 	Encoder notify;
-	amf_write(&notify, std::string("onMetaData"));
-	amf_write_ecma(&notify, metadata);
+	amf_write(&notify, "onMetaData");
+	amf_write(&notify, metadata);
+	publish_metadata(client, notify.buf);
+}
 
-	FOR_EACH(std::vector<Client *>, i, clients) {
-		Client *client = *i;
-		if (client != NULL && client->playing) {
-			rtmp_send(client, MSG_NOTIFY, STREAM_ID, notify.buf);
+/* Asks the origin to play the stream once it has created one for us */
+void handle_relay_result(Client *client, double txid, Decoder *dec)
+{
+	if (txid != 2.0)
+		return;
+	amf_load(dec); /* NULL */
+	double id = amf_load_number(dec);
+
+	const std::string &name = client->stream->name;
+	Encoder enc;
+	amf_write(&enc, "play");
+	amf_write(&enc, 0.0);
+	amf_write_null(&enc);
+	amf_write(&enc, std::string_view(name).substr(name.find('/') + 1));
+	rtmp_send(client, MSG_INVOKE, uint32_t(id), enc.buf, 0, CHAN_STREAM);
+}
+
+void handle_relay_invoke(Client *client, std::string_view method,
+			 double txid, Decoder *dec)
+{
+	if (method == "_result") {
+		handle_relay_result(client, txid, dec);
+	} else if (method == "_error") {
+		throw std::runtime_error("origin refused the relay");
+	} else if (method == "onStatus") {
+		amf_load(dec); /* NULL */
+		AMFValue code = amf_load_object(dec).get("code");
+		if (code.type() == AMF_STRING) {
+			debug("origin status %.*s\n",
+			      int(code.as_string().size()),
+			      code.as_string().data());
+			if (code.as_string() == "NetStream.Play.Start" &&
+			    client->relay) {
+				client->relay->backoff = RETRY_MIN;
+			}
+			if (code.as_string() == "NetStream.Play.StreamNotFound" ||
+			    code.as_string() == "NetStream.Play.Failed") {
+				throw std::runtime_error("origin can not play " +
+							 client->stream->name);
+			}
+		}
+	}
+}
+
+/* Publishes the stream to the target once it has created one for us */
+void handle_push_result(Client *client, double txid, Decoder *dec)
+{
+	if (txid != 2.0)
+		return;
+	amf_load(dec); /* NULL */
+	client->stream_id = amf_load_number(dec);
+
+	const std::string &name = client->push->stream->name;
+	Encoder enc;
+	amf_write(&enc, "publish");
+	amf_write(&enc, 0.0);
+	amf_write_null(&enc);
+	amf_write(&enc, std::string_view(name).substr(name.find('/') + 1));
+	amf_write(&enc, "live");
+	rtmp_send(client, MSG_INVOKE, client->stream_id, enc.buf, 0,
+		  CHAN_STREAM);
+}
+
+void handle_push_invoke(Client *client, std::string_view method,
+			double txid, Decoder *dec)
+{
+	if (method == "_result") {
+		handle_push_result(client, txid, dec);
+	} else if (method == "_error") {
+		throw std::runtime_error("push target refused the stream");
+	} else if (method == "onStatus") {
+		amf_load(dec); /* NULL */
+		AMFValue status = amf_load_object(dec);
+		AMFValue code = status.get("code");
+		AMFValue level = status.get("level");
+		if (code.type() == AMF_STRING &&
+		    code.as_string() == "NetStream.Publish.Start") {
+			Push *push = client->push;
+			printf("pushing %s to %s\n", push->stream->name.c_str(),
+			       push->target->host.c_str());
+			push->backoff = RETRY_MIN;
+			subscribe(client, push->stream->name);
+			join_stream(client);
+		} else if (level.type() == AMF_STRING &&
+			   level.as_string() == "error") {
+			throw std::runtime_error("push target can not publish " +
+						 client->push->stream->name);
 		}
 	}
 }
 
 void handle_invoke(Client *client, const RTMP_Message *msg, Decoder *dec)
 {
-	std::string method = amf_load_string(dec);
+	std::string_view method = amf_load_string_view(dec);
 	double txid = amf_load_number(dec);
 
-	debug("invoked %s\n", method.c_str());
+	debug("invoked %.*s\n", int(method.size()), method.data());
+
+	if (client->kind == CLIENT_RELAY) {
+		handle_relay_invoke(client, method, txid, dec);
+		return;
+	}
+	if (client->kind == CLIENT_PUSH) {
+		handle_push_invoke(client, method, txid, dec);
+		return;
+	}
 
 	if (msg->endpoint == CONTROL_ID) {
 		if (method == "connect") {
@@ -441,6 +1725,8 @@ void handle_invoke(Client *client, const RTMP_Message *msg, Decoder *dec)
 			handle_play2(client, txid, dec);
 		} else if (method == "pause") {
 			handle_pause(client, txid, dec);
+		} else if (method == "seek") {
+			handle_seek(client, txid, dec);
 		}
 	}
 }
@@ -460,44 +1746,83 @@ void handle_message(Client *client, RTMP_Message *msg)
 			throw std::runtime_error("Not enough data");
 		}
 		client->read_seq = load_be32(&msg->buf[pos]);
-		debug("%d in queue\n",
-			int(client->written_seq - client->read_seq));
+		client->acks_seen = true;
+		break;
+
+	case MSG_WINDOW_ACK_SIZE:
+		if (pos + 4 > msg->buf.size()) {
+			throw std::runtime_error("Not enough data");
+		}
+		client->ack_window = load_be32(&msg->buf[pos]);
+		if (client->ack_window == 0) {
+			throw std::runtime_error("invalid window size");
+		}
+		debug("window size set to %u\n", client->ack_window);
+		break;
+
+	case MSG_SET_PEER_BW:
+		/* we do not limit our sending rate */
+		break;
+
+	case MSG_USER_CONTROL:
+		if (msg->buf.size() >= 6 &&
+		    load_be16(&msg->buf[0]) == CONTROL_PING) {
+			std::string pong = msg->buf;
+			pong[0] = 0;
+			pong[1] = CONTROL_PONG;
+			rtmp_send(client, MSG_USER_CONTROL, CONTROL_ID, pong);
+		}
 		break;
 
 	case MSG_SET_CHUNK:
 		if (pos + 4 > msg->buf.size()) {
 			throw std::runtime_error("Not enough data");
 		}
-		client->chunk_len = load_be32(&msg->buf[pos]);
-		debug("chunk size set to %zu\n", client->chunk_len);
+		client->parser.chunk_len = load_be32(&msg->buf[pos]);
+		if (client->parser.chunk_len == 0 ||
+		    client->parser.chunk_len > MAX_PEER_CHUNK) {
+			throw std::runtime_error("invalid chunk size");
+		}
+		debug("chunk size set to %zu\n", client->parser.chunk_len);
 		break;
 
 	case MSG_INVOKE: {
+			Arena arena;
 			Decoder dec;
 			dec.version = 0;
 			dec.buf = msg->buf;
 			dec.pos = 0;
+			dec.arena = &arena;
 			handle_invoke(client, msg, &dec);
 		}
 		break;
 
 	case MSG_INVOKE3: {
+			Arena arena;
 			Decoder dec;
 			dec.version = 0;
 			dec.buf = msg->buf;
 			dec.pos = 1;
+			dec.arena = &arena;
 			handle_invoke(client, msg, &dec);
 		}
 		break;
 
 	case MSG_NOTIFY: {
+			Arena arena;
 			Decoder dec;
 			dec.version = 0;
 			dec.buf = msg->buf;
 			dec.pos = 0;
-			std::string type = amf_load_string(&dec);
-			debug("notify %s\n", type.c_str());
-			if (msg->endpoint == STREAM_ID) {
+			dec.arena = &arena;
+			std::string_view type = amf_load_string_view(&dec);
+			debug("notify %.*s\n", int(type.size()), type.data());
+			if (client->kind == CLIENT_RELAY) {
+				/* the origin sends metadata as we do */
+				if (type == "onMetaData") {
+					publish_metadata(client, msg->buf);
+				}
+			} else if (msg->endpoint == STREAM_ID) {
 				if (type == "@setDataFrame") {
 					handle_setdataframe(client, &dec);
 				}
@@ -506,43 +1831,20 @@ void handle_message(Client *client, RTMP_Message *msg)
 		break;
 
 	case MSG_AUDIO:
-		if (client != publisher) {
-			throw std::runtime_error("not a publisher");
-		}
-		FOR_EACH(std::vector<Client *>, i, clients) {
-			Client *receiver = *i;
-			if (receiver != NULL && receiver->ready) {
-				rtmp_send(receiver, MSG_AUDIO, STREAM_ID,
-					  msg->buf, msg->timestamp);
-			}
-		}
-		break;
-
 	case MSG_VIDEO: {
-		if (client != publisher) {
+		if (!client->publishing) {
 			throw std::runtime_error("not a publisher");
 		}
-		uint8_t flags = msg->buf[0];
-		FOR_EACH(std::vector<Client *>, i, clients) {
-			Client *receiver = *i;
-			if (receiver != NULL && receiver->playing) {
-				if (flags >> 4 == FLV_KEY_FRAME &&
-				    !receiver->ready) {
-					std::string control;
-					uint16_t type = htons(CONTROL_CLEAR_STREAM);
-					control.append((char *) &type, 2);
-					uint32_t stream = htonl(STREAM_ID);
-					control.append((char *) &stream, 4);
-					rtmp_send(receiver, MSG_USER_CONTROL, CONTROL_ID, control);
-					receiver->ready = true;
-				}
-				if (receiver->ready) {
-					rtmp_send(receiver, MSG_VIDEO,
-						  STREAM_ID, msg->buf,
-						  msg->timestamp);
-				}
-			}
-		}
+		StreamEvent event;
+		event.stream = client->stream;
+		event.type = msg->type;
+		event.timestamp = msg->timestamp;
+		/* the payload is handed over, not copied */
+		event.buf = pool_share(msg->buf);
+		event.recv_time = client->recv_time;
+		event.traced = trace_every &&
+			++client->trace_count % trace_every == 0;
+		publish_message(client, event);
 		}
 		break;
 
@@ -557,261 +1859,1454 @@ void handle_message(Client *client, RTMP_Message *msg)
 	}
 }
 
-/* TODO: Make this asynchronous */
-void do_handshake(Client *client)
+/* Encodes an onStatus-like command with the given status object */
+std::string encode_status(const char *command, const AMFValue &status)
 {
-	Handshake serversig;
-	Handshake clientsig;
+	Encoder enc;
+	amf_write(&enc, command);
+	amf_write(&enc, 0.0);
+	amf_write_null(&enc);
+	amf_write(&enc, status);
+	return enc.buf;
+}
 
-	uint8_t c;
-	if (recv_all(client->fd, &c, 1) < 1)
-		return;
-	if (c != HANDSHAKE_PLAINTEXT) {
-		throw std::runtime_error("only plaintext handshake supported");
+/*
+ * Builds a template for a status command whose last property is variable.
+ * The object end marker goes to the tail.
+ */
+Template status_template(const char *command, const AMFValue &status,
+			 const char *key)
+{
+	std::string buf = encode_status(command, status);
+	Template tmpl;
+	tmpl.head = buf.substr(0, buf.size() - 3);
+	tmpl.tail = buf.substr(buf.size() - 3);
+	Encoder enc;
+	amf_write_key(&enc, key);
+	tmpl.head += enc.buf;
+	return tmpl;
+}
+
+/* A "_result" reply followed by the transaction id and the given tail */
+Template result_template(const AMFValue &reply, const AMFValue &status)
+{
+	Template tmpl;
+	Encoder enc;
+	amf_write(&enc, "_result");
+	tmpl.head = enc.buf;
+	enc.buf.clear();
+	amf_write(&enc, reply);
+	amf_write(&enc, status);
+	tmpl.tail = enc.buf;
+	return tmpl;
+}
+
+void init_templates()
+{
+	Arena arena;
+
+	templates.result = result_template(AMFValue(), AMFValue());
+
+	AMFValue version = AMFValue::object(&arena, {
+		{"fmsVer", "FMS/4,5,1,484"},
+		{"capabilities", 255.0},
+		{"mode", 1.0},
+	});
+	AMFValue status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetConnection.Connect.Success"},
+		{"description", "Connection succeeded."},
+		/* report support for AMF3 */
+		{"objectEncoding", 3.0},
+	});
+	templates.connect_result = result_template(version, status);
+
+	templates.createstream_result =
+		result_template(AMFValue(), double(STREAM_ID));
+
+	status = AMFValue::object(&arena, {
+		{"code", "NetStream.Publish.Start"},
+	});
+	templates.fcpublish_status =
+		status_template("onFCPublish", status, "description");
+
+	status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetStream.Publish.Start"},
+		{"description", "Stream is now published."},
+	});
+	templates.publish_status =
+		status_template("onStatus", status, "details");
+
+	status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetStream.Play.Reset"},
+		{"description", "Resetting and playing stream."},
+	});
+	templates.play_reset = encode_status("onStatus", status);
+
+	status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetStream.Play.Start"},
+		{"description", "Started playing."},
+	});
+	templates.play_start = encode_status("onStatus", status);
+
+	Encoder enc;
+	amf_write(&enc, "|RtmpSampleAccess");
+	amf_write(&enc, true);
+	amf_write(&enc, true);
+	templates.sample_access = enc.buf;
+
+	status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetStream.Pause.Notify"},
+		{"description", "Pausing."},
+	});
+	templates.pause_notify = encode_status("onStatus", status);
+
+	status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetStream.Play.Stop"},
+		{"description", "Stopped playing."},
+	});
+	templates.play_stop = encode_status("onStatus", status);
+
+	status = AMFValue::object(&arena, {
+		{"level", "status"},
+		{"code", "NetStream.Seek.Notify"},
+		{"description", "Seeking."},
+	});
+	templates.seek_notify = encode_status("onStatus", status);
+}
+
+void init_handshake_pool()
+{
+	std::string pool;
+	for (int i = 0; i < HANDSHAKE_POOL_LEN; ++i) {
+		Handshake serversig;
+		memset(&serversig, 0, sizeof serversig);
+		serversig.flags[0] = 0x03;
+		for (int j = 0; j < RANDOM_LEN; ++j) {
+			serversig.random[j] = rand();
+		}
+		pool += char(HANDSHAKE_PLAINTEXT);
+		pool.append((char *) &serversig, sizeof serversig);
 	}
+	handshake_pool = std::make_shared<const std::string>(pool);
+}
 
-	if (send_all(client->fd, &c, 1) < 1)
-		return;
+/* Connects to the app of the stream on a server we are a client of */
+void send_connect(Client *client, const Target &target,
+		  const std::string &name)
+{
+	std::string app = name.substr(0, name.find('/'));
+	std::string tc_url = "rtmp://" + target.host + "/" + app;
+
+	Arena arena;
+	Encoder enc;
+	amf_write(&enc, "connect");
+	amf_write(&enc, 1.0);
+	amf_write(&enc, AMFValue::object(&arena, {
+		{"app", app},
+		{"flashVer", "LNX 9,0,124,2"},
+		{"tcUrl", tc_url},
+	}));
+	rtmp_send(client, MSG_INVOKE, CONTROL_ID, enc.buf, 0, CHAN_RESULT);
+}
+
+void send_createstream(Client *client)
+{
+	Encoder enc;
+	amf_write(&enc, "createStream");
+	amf_write(&enc, 2.0);
+	amf_write_null(&enc);
+	rtmp_send(client, MSG_INVOKE, CONTROL_ID, enc.buf, 0, CHAN_RESULT);
+}
+
+/* Opens the session with the origin, right after the handshake */
+void relay_connect(Client *client)
+{
+	send_connect(client, origin, client->stream->name);
+	send_createstream(client);
+}
+
+/*
+ * Opens the session with a push target. Our chunk size is announced first,
+ * so that the media shares the chunked buffers of the local viewers.
+ */
+void push_connect(Client *client)
+{
+	const std::string &name = client->push->stream->name;
+	send_chunk_len(client);
+	send_connect(client, *client->push->target, name);
+
+	Encoder enc;
+	amf_write(&enc, "FCPublish");
+	amf_write(&enc, 3.0);
+	amf_write_null(&enc);
+	amf_write(&enc, std::string_view(name).substr(name.find('/') + 1));
+	rtmp_send(client, MSG_INVOKE, CONTROL_ID, enc.buf, 0, CHAN_RESULT);
+
+	send_createstream(client);
+}
+
+/*
+ * Runs the handshake as far as the received data allows. Returns false if
+ * more data is needed.
+ */
+bool do_handshake(Client *client)
+{
+	switch (client->handshake_state) {
+	case HANDSHAKE_C0C1: {
+		if (client->buf.size() < 1 + sizeof(Handshake))
+			return false;
+		if (client->buf.at(0) != HANDSHAKE_PLAINTEXT) {
+			throw std::runtime_error("only plaintext handshake supported");
+		}
+
+		Worker *worker = client->worker;
+		client->handshake_sig = (1 + sizeof(Handshake)) *
+			(worker->next_sig++ % HANDSHAKE_POOL_LEN);
+		queue_send(client, handshake_pool, client->handshake_sig,
+			   1 + sizeof(Handshake));
+
+		/* Echo client's signature back */
+		std::string clientsig;
+		client->buf.append_to(clientsig, 1, sizeof(Handshake));
+		queue_send(client, std::make_shared<const std::string>(
+				std::move(clientsig)));
+		client->buf.consume(1 + sizeof(Handshake));
+		client->handshake_state = HANDSHAKE_C2;
+		}
+		/* fall through */
+
+	case HANDSHAKE_C2: {
+		if (client->buf.size() < sizeof(Handshake))
+			return false;
+		const Handshake *serversig = (const Handshake *)
+			&(*handshake_pool)[client->handshake_sig + 1];
+		Handshake clientsig;
+		client->buf.copy(0, &clientsig, sizeof clientsig);
+		if (memcmp(serversig->random, clientsig.random,
+			   RANDOM_LEN) != 0) {
+			throw std::runtime_error("invalid handshake");
+		}
+		client->buf.consume(sizeof(Handshake));
+		client->handshake_state = HANDSHAKE_DONE;
+
+		client->read_seq = 1 + sizeof(Handshake) * 2;
+		client->written_seq = 1 + sizeof(Handshake) * 2;
+		}
+		break;
+
+	case HANDSHAKE_S0S1S2: {
+		/* our C0+C1 was queued when connecting */
+		if (client->buf.size() < 1 + sizeof(Handshake) * 2)
+			return false;
+		if (client->buf.at(0) != HANDSHAKE_PLAINTEXT) {
+			throw std::runtime_error("only plaintext handshake supported");
+		}
+		/* Echo server's signature back */
+		std::string serversig;
+		client->buf.append_to(serversig, 1, sizeof(Handshake));
+		queue_send(client, std::make_shared<const std::string>(
+				std::move(serversig)));
+		client->buf.consume(1 + sizeof(Handshake) * 2);
+		client->handshake_state = HANDSHAKE_DONE;
+
+		client->read_seq = 1 + sizeof(Handshake) * 2;
+		client->written_seq = 1 + sizeof(Handshake) * 2;
+		if (client->kind == CLIENT_PUSH) {
+			push_connect(client);
+		} else {
+			relay_connect(client);
+		}
+		}
+		break;
 
-	memset(&serversig, 0, sizeof serversig);
-	serversig.flags[0] = 0x03;
-	for (int i = 0; i < RANDOM_LEN; ++i) {
-		serversig.random[i] = rand();
+	case HANDSHAKE_DONE:
+		break;
 	}
+	return true;
+}
 
-	if (send_all(client->fd, &serversig, sizeof serversig) < sizeof serversig)
-		return;
+/*
+ * Parses the received chunks in place. Chunk payload is copied to the
+ * message as soon as it arrives, so only a partial chunk header is ever
+ * left in the receive buffer.
+ */
+void parse_chunks(Client *client)
+{
+	while (RTMP_Message *msg = client->parser.next(&client->buf)) {
+		handle_message(client, msg);
+	}
+}
 
-	/* Echo client's signature back */
-	if (recv_all(client->fd, &clientsig, sizeof serversig) < sizeof serversig)
-		return;
-	if (send_all(client->fd, &clientsig, sizeof serversig) < sizeof serversig)
+/* Acknowledges the received bytes when the peer's window is full */
+void send_ack(Client *client)
+{
+	if (client->recv_seq - client->acked_seq < client->ack_window)
 		return;
+	uint32_t seq = htonl(client->recv_seq);
+	std::string ack((char *) &seq, 4);
+	rtmp_send(client, MSG_BYTES_READ, CONTROL_ID, ack);
+	client->acked_seq = client->recv_seq;
+}
 
-	if (recv_all(client->fd, &clientsig, sizeof serversig) < sizeof serversig)
-		return;
-	if (memcmp(serversig.random, clientsig.random, RANDOM_LEN) != 0) {
-		throw std::runtime_error("invalid handshake");
-	}
+enum {
+	METRIC_CONNECTIONS,
+	METRIC_ACCEPTED,
+	METRIC_BYTES_IN,
+	METRIC_BYTES_OUT,
+	METRIC_DROPPED,
+	METRIC_LOOP_TIME,
+	METRIC_STREAM_BITRATE,
+	METRIC_STREAM_FPS,
+	METRIC_STREAM_KEYFRAME_INTERVAL,
+	METRIC_STREAM_VIEWERS,
+	METRIC_STREAM_PUSHES,
+	METRIC_CLIENT_QUEUED,
+	METRIC_CLIENT_UNACKED,
+	METRIC_CLIENT_DROPPED,
+	METRIC_CLIENT_BYTES_IN,
+	METRIC_CLIENT_BYTES_OUT,
+	METRIC_STREAM_LATENCY,
+	METRIC_STREAM_LATENCY_QUANTILE,
+	NUM_METRICS
+};
+
+const MetricFamily metric_families[NUM_METRICS] = {
+	{"rtmp_connections", "gauge",
+	 "Open connections: RTMP and HTTP-FLV clients, relays and pushes."},
+	{"rtmp_accepted_total", "counter",
+	 "Accepted RTMP and HTTP-FLV connections."},
+	{"rtmp_received_bytes_total", "counter",
+	 "Bytes received from clients."},
+	{"rtmp_sent_bytes_total", "counter", "Bytes sent to clients."},
+	{"rtmp_dropped_messages_total", "counter",
+	 "Media messages not sent to congested viewers or workers."},
+	{"rtmp_loop_seconds", "histogram",
+	 "Time spent handling the events of one event loop iteration."},
+	{"rtmp_stream_ingest_bits_per_second", "gauge",
+	 "Media bitrate received from the publisher."},
+	{"rtmp_stream_ingest_fps", "gauge",
+	 "Video frames per second received from the publisher."},
+	{"rtmp_stream_keyframe_interval_seconds", "gauge",
+	 "Time between the last two keyframes from the publisher."},
+	{"rtmp_stream_viewers", "gauge", "Viewers of the stream."},
+	{"rtmp_stream_pushes", "gauge",
+	 "Push targets the stream is being forwarded to."},
+	{"rtmp_client_queued_bytes", "gauge",
+	 "Bytes in the send queue of the client."},
+	{"rtmp_client_unacked_bytes", "gauge",
+	 "Bytes queued to the client and not yet acknowledged by it."},
+	{"rtmp_client_dropped_messages_total", "counter",
+	 "Media messages not sent to the client due to congestion."},
+	{"rtmp_client_received_bytes_total", "counter",
+	 "Bytes received from the client."},
+	{"rtmp_client_sent_bytes_total", "counter",
+	 "Bytes sent to the client."},
+	{"rtmp_stream_latency_seconds", "histogram",
+	 "Latency of relayed media messages, by stage."},
+	{"rtmp_stream_latency_quantile_seconds", "gauge",
+	 "Latency quantiles since the previous scrape, by stage."},
+};
+
+const char *stage_names[NUM_STAGES] = {"ingest", "queue", "total"};
 
-	client->read_seq = 1 + sizeof serversig * 2;
-	client->written_seq = 1 + sizeof serversig * 2;
+void add_sample(std::vector<std::string> *samples, int metric,
+		const std::string &labels, double value)
+{
+	metric_sample(&(*samples)[metric], metric_families[metric].name,
+		      labels, value);
 }
 
-void recv_from_client(Client *client)
+/* Renders the samples of the worker's counters and clients */
+void render_metrics(Worker *worker, std::vector<std::string> *samples)
 {
-	std::string chunk(4096, 0);
-	ssize_t got = recv(client->fd, &chunk[0], chunk.size(), 0);
-	if (got == 0) {
-		throw std::runtime_error("EOF from a client");
-	} else if (got < 0) {
-		if (errno == EAGAIN || errno == EINTR)
-			return;
-		throw std::runtime_error(strf("unable to read from a client: %s",
-					      strerror(errno)));
-	}
-	client->buf.append(chunk, 0, got);
+	samples->assign(NUM_METRICS, std::string());
 
-	while (!client->buf.empty()) {
-		uint8_t flags = client->buf[0];
+	std::string labels = metric_label("worker", strf("%zu", worker->id));
+	size_t connections = 0;
+	FOR_EACH(std::vector<Client *>, i, worker->clients) {
+		if ((*i)->kind != CLIENT_METRICS)
+			connections++;
+	}
+	add_sample(samples, METRIC_CONNECTIONS, labels, connections);
+	add_sample(samples, METRIC_ACCEPTED, labels, worker->accepted);
+	add_sample(samples, METRIC_BYTES_IN, labels, worker->bytes_in);
+	add_sample(samples, METRIC_BYTES_OUT, labels, worker->bytes_out);
+	add_sample(samples, METRIC_DROPPED, labels, worker->dropped);
+	metric_histogram(&(*samples)[METRIC_LOOP_TIME],
+			 metric_families[METRIC_LOOP_TIME].name, labels,
+			 worker->loop_time);
+
+	FOR_EACH(std::vector<Client *>, i, worker->clients) {
+		Client *client = *i;
+		if (client->kind == CLIENT_METRICS)
+			continue;
+		labels = metric_label("client", strf("%llu",
+					(unsigned long long) client->id));
+		if (client->stream) {
+			labels += "," + metric_label("stream",
+						     client->stream->name);
+		}
+		add_sample(samples, METRIC_CLIENT_QUEUED, labels,
+			   client->queued);
+		if (client->acks_seen) {
+			add_sample(samples, METRIC_CLIENT_UNACKED, labels,
+				   uint32_t(client->written_seq -
+					    client->read_seq));
+		}
+		add_sample(samples, METRIC_CLIENT_DROPPED, labels,
+			   client->dropped);
+		add_sample(samples, METRIC_CLIENT_BYTES_IN, labels,
+			   client->bytes_in);
+		add_sample(samples, METRIC_CLIENT_BYTES_OUT, labels,
+			   client->bytes_out);
+
+		if (!client->publishing)
+			continue;
+		/* streams are reported by the worker of their publisher */
+		labels = metric_label("stream", client->stream->name);
+		add_sample(samples, METRIC_STREAM_BITRATE, labels,
+			   client->ingest_bitrate);
+		add_sample(samples, METRIC_STREAM_FPS, labels,
+			   client->ingest_fps);
+		if (client->keyframe_interval) {
+			add_sample(samples, METRIC_STREAM_KEYFRAME_INTERVAL,
+				   labels, client->keyframe_interval / 1000.0);
+		}
+		size_t viewers, pushes;
+		{
+			std::lock_guard<std::mutex> lock(registry_lock);
+			viewers = client->stream->viewers;
+			pushes = client->stream->pushes;
+		}
+		add_sample(samples, METRIC_STREAM_VIEWERS, labels, viewers);
+		add_sample(samples, METRIC_STREAM_PUSHES, labels, pushes);
+	}
+}
 
-		static const size_t HEADER_LENGTH[] = {12, 8, 4, 1};
-		size_t header_len = HEADER_LENGTH[flags >> 6];
+/* Takes the latencies of the streams relayed by the worker */
+void collect_latency(Worker *worker, latency_map_t *out)
+{
+	std::lock_guard<std::mutex> lock(registry_lock);
+	FOR_EACH(registry_t, i, streams) {
+		/* only this thread touches its part of the stream */
+		StreamLatency &latency = i->second->local[worker->id].latency;
+		if (latency.total[STAGE_INGEST].count == 0)
+			continue;
+		(*out)[i->first] = latency;
+		for (int j = 0; j < NUM_STAGES; ++j) {
+			latency.recent[j] = Histogram();
+		}
+	}
+}
 
-		if (client->buf.size() < header_len) {
-			/* need more data */
-			break;
+void render_latency(const latency_map_t &latency,
+		    std::vector<std::string> *samples)
+{
+	static const double quantiles[] = {0.5, 0.99, 1};
+
+	samples->assign(NUM_METRICS, std::string());
+	FOR_EACH_CONST(latency_map_t, i, latency) {
+		for (int j = 0; j < NUM_STAGES; ++j) {
+			std::string labels = metric_label("stream", i->first) +
+				"," + metric_label("stage", stage_names[j]);
+			metric_histogram(&(*samples)[METRIC_STREAM_LATENCY],
+				metric_families[METRIC_STREAM_LATENCY].name,
+				labels, i->second.total[j]);
+			for (int k = 0; k < 3; ++k) {
+				add_sample(samples,
+					   METRIC_STREAM_LATENCY_QUANTILE,
+					   labels + "," + metric_label(
+						"quantile",
+						strf("%g", quantiles[k])),
+					   i->second.recent[j].quantile(
+						quantiles[k]));
+			}
 		}
+	}
+}
 
-		RTMP_Header header;
-		memcpy(&header, client->buf.data(), header_len);
+/* Renders a round of samples for the scraping worker to pick up */
+void update_metrics(Worker *worker, uint64_t round)
+{
+	std::vector<std::string> samples;
+	render_metrics(worker, &samples);
+	latency_map_t latency;
+	collect_latency(worker, &latency);
+
+	std::lock_guard<std::mutex> lock(worker->metrics_lock);
+	worker->metrics.swap(samples);
+	worker->metrics_latency.swap(latency);
+	worker->metrics_round = round;
+}
 
-		RTMP_Message *msg = &client->messages[flags & 0x3f];
+/* Answers the waiting scrapers once every worker has rendered its samples */
+void finish_scrape(Worker *worker)
+{
+	if (worker->scrapers.empty())
+		return;
 
-		if (header_len >= 8) {
-			msg->len = load_be24(header.msg_len);
-			if (msg->len < msg->buf.size()) {
-				throw std::runtime_error("invalid msg length");
-			}
-			msg->type = header.msg_type;
+	std::vector<std::vector<std::string> > parts;
+	latency_map_t latency;
+	FOR_EACH(std::vector<Worker *>, i, workers) {
+		Worker *w = *i;
+		std::lock_guard<std::mutex> lock(w->metrics_lock);
+		if (w->metrics_round != worker->scrape_round)
+			return;
+		parts.push_back(w->metrics);
+		FOR_EACH(latency_map_t, j, w->metrics_latency) {
+			latency[j->first].merge(j->second);
 		}
-		if (header_len >= 12) {
-			msg->endpoint = load_le32(header.endpoint);
+	}
+	/* a stream is relayed by every worker with viewers for it */
+	parts.push_back(std::vector<std::string>());
+	render_latency(latency, &parts.back());
+
+	/* the samples of a family must be together, under one header */
+	std::string body;
+	for (int m = 0; m < NUM_METRICS; ++m) {
+		metric_header(&body, metric_families[m]);
+		FOR_EACH(std::vector<std::vector<std::string> >, i, parts) {
+			body += (*i)[m];
 		}
+	}
+	std::string response = strf("HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n\r\n", body.size());
+	response += body;
+
+	shared_buf_t data = std::make_shared<const std::string>(
+		std::move(response));
+	FOR_EACH(std::vector<Client *>, i, worker->scrapers) {
+		queue_send(*i, data);
+		(*i)->hangup = true;
+	}
+	worker->scrapers.clear();
+}
 
-		if (msg->len == 0) {
-			throw std::runtime_error("message without a header");
+/*
+ * Reads the request of an HTTP client, returns false until it is complete.
+ * Anything received after the request is ignored.
+ */
+bool read_request(Client *client, std::string *request)
+{
+	if (client->request_done) {
+		client->buf.consume(client->buf.size());
+		return false;
+	}
+	client->buf.append_to(*request, 0, client->buf.size());
+	if (request->find("\r\n\r\n") == std::string::npos) {
+		if (request->size() >= MAX_HTTP_REQUEST) {
+			throw std::runtime_error("HTTP request too large");
 		}
-		size_t chunk = msg->len - msg->buf.size();
-		if (chunk > client->chunk_len)
-			chunk = client->chunk_len;
+		return false;
+	}
+	client->buf.consume(client->buf.size());
+	client->request_done = true;
+	return true;
+}
 
-		if (client->buf.size() < header_len + chunk) {
-			/* need more data */
-			break;
-		}
+void send_not_found(Client *client)
+{
+	std::string response = "HTTP/1.0 404 Not Found\r\n"
+		"Connection: close\r\n\r\n";
+	queue_send(client, pool_share(response));
+	client->hangup = true;
+}
 
-		if (header_len >= 4) {
-			unsigned long ts = load_be24(header.timestamp);
-			if (ts == 0xffffff) {
-				throw std::runtime_error("ext timestamp not supported");
-			}
-			if (header_len < 12) {
-				ts += msg->timestamp;
+/* Serves GET /metrics, asking every worker for its samples first */
+void handle_scrape(Client *client)
+{
+	std::string request;
+	if (!read_request(client, &request))
+		return;
+
+	if (request.compare(0, 13, "GET /metrics ") != 0) {
+		send_not_found(client);
+		return;
+	}
+
+	Worker *worker = client->worker;
+	if (worker->scrapers.empty()) {
+		worker->scrape_round++;
+		FOR_EACH(std::vector<Worker *>, i, workers) {
+			Worker *w = *i;
+			w->metrics_wanted = worker->scrape_round;
+			if (w != worker) {
+				worker->wake_pending[w->id] = true;
 			}
-			msg->timestamp = ts;
 		}
+		update_metrics(worker, worker->scrape_round);
+	}
+	worker->scrapers.push_back(client);
+	finish_scrape(worker);
+}
 
-		msg->buf.append(client->buf, header_len, chunk);
-		client->buf.erase(0, header_len + chunk);
+/*
+ * Serves "GET /app/stream.flv": the FLV header followed by the live stream
+ * as FLV tags, starting with the metadata, sequence headers and current GOP
+ * like an RTMP viewer.
+ */
+void handle_http(Client *client)
+{
+	std::string request;
+	if (!read_request(client, &request))
+		return;
 
-		if (msg->buf.size() == msg->len) {
-			handle_message(client, msg);
-			msg->buf.clear();
-		}
+	std::string_view path = request;
+	path = path.substr(0, path.find("\r\n"));
+	if (path.substr(0, 5) != "GET /") {
+		send_not_found(client);
+		return;
 	}
+	path = path.substr(5);
+	path = path.substr(0, path.find(' '));
+	path = path.substr(0, path.find('?'));
+	size_t slash = path.find('/');
+	if (slash == 0 || slash == std::string_view::npos ||
+	    path.size() <= slash + 5 || path.substr(path.size() - 4) != ".flv") {
+		send_not_found(client);
+		return;
+	}
+	client->app = path.substr(0, slash);
+	std::string_view name = path.substr(slash + 1,
+					    path.size() - slash - 5);
+	debug("http play %.*s\n", int(name.size()), name.data());
+
+	std::string response = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: video/x-flv\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Connection: close\r\n\r\n";
+	response += flv_file_header();
+	queue_send(client, pool_share(response));
+
+	watch_stream(client, stream_name(client, name));
+	join_stream(client);
 }
 
-Client *new_client()
+void close_client(Client *client);
+
+void recv_from_client(Client *client)
 {
-	sockaddr_in sin;
-	socklen_t addrlen = sizeof sin;
-	int fd = accept(listen_fd, (sockaddr *) &sin, &addrlen);
-	if (fd < 0) {
-		printf("Unable to accept a client: %s\n", strerror(errno));
-		return NULL;
+	for (;;) {
+		iovec iov[2];
+		int count = client->buf.free_space(iov);
+		size_t space = client->buf.capacity() - client->buf.size();
+		ssize_t got = readv(client->fd, iov, count);
+		if (got == 0) {
+			throw std::runtime_error("EOF from a client");
+		} else if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			throw std::runtime_error(strf("unable to read from a client: %s",
+						      strerror(errno)));
+		}
+		client->buf.produce(got);
+		client->recv_time = now_us();
+		client->recv_seq += got;
+		client->bytes_in += got;
+		client->worker->bytes_in += got;
+
+		if (client->kind == CLIENT_METRICS) {
+			handle_scrape(client);
+		} else if (client->kind == CLIENT_HTTP) {
+			handle_http(client);
+		} else if (do_handshake(client)) {
+			parse_chunks(client);
+			send_ack(client);
+		}
+
+		/* a busy publisher gets larger reads */
+		if (size_t(got) == space &&
+		    client->buf.capacity() < MAX_RECV_BUF) {
+			client->buf.grow();
+		}
 	}
+}
 
+Client *new_client(Worker *worker, int fd, ClientKind kind)
+{
 	Client *client = new Client;
+	client->worker = worker;
+	client->kind = kind;
+	client->id = next_client_id++;
+	client->request_done = false;
+	client->hangup = false;
+	client->bytes_in = 0;
+	client->bytes_out = 0;
+	client->trace_count = 0;
 	client->playing = false;
 	client->ready = false;
+	client->stream_id = STREAM_ID;
+	client->push = NULL;
+	client->relay = NULL;
 	client->fd = fd;
+	client->handshake_state = HANDSHAKE_C0C1;
+	client->publishing = false;
+	client->parser.max_message = MAX_CONTROL_MESSAGE;
+	client->queued = 0;
+	client->burst_left = 0;
+	client->queued_ts = 0;
+	client->sent_ts = 0;
+	client->skip_video = false;
+	client->dropped = 0;
 	client->written_seq = 0;
 	client->read_seq = 0;
-	client->chunk_len = DEFAULT_CHUNK_LEN;
+	client->acks_seen = false;
+	client->recv_seq = 0;
+	client->acked_seq = 0;
+	client->ack_window = DEFAULT_WINDOW;
+	client->want_write = false;
+	client->flush_pending = false;
+	client->out_chunk_len = DEFAULT_CHUNK_LEN;
 	for (int i = 0; i < 64; ++i) {
-		client->messages[i].timestamp = 0;
-		client->messages[i].len = 0;
+		client->out_chunks[i].valid = false;
 	}
 
-	try {
-		do_handshake(client);
-	} catch (const std::runtime_error &e) {
-		printf("handshake failed: %s\n", e.what());
+	set_nonblock(fd, true);
+
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = client;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		printf("Unable to add a client: %s\n", strerror(errno));
 		close(fd);
 		delete client;
 		return NULL;
 	}
 
+	client->index = worker->clients.size();
+	worker->clients.push_back(client);
+	return client;
+}
+
+void accept_clients(Worker *worker, int listen_fd, ClientKind kind)
+{
+	for (;;) {
+		sockaddr_in sin;
+		socklen_t addrlen = sizeof sin;
+		int fd = accept(listen_fd, (sockaddr *) &sin, &addrlen);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			printf("Unable to accept a client: %s\n", strerror(errno));
+			return;
+		}
+		if (kind == CLIENT_RTMP || kind == CLIENT_HTTP) {
+			worker->accepted++;
+		}
+		new_client(worker, fd, kind);
+	}
+}
+
+/* Starts connecting to a server, returns the socket or -1 */
+int connect_to(const Target &target)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		printf("Unable to create socket: %s\n", strerror(errno));
+		return -1;
+	}
 	set_nonblock(fd, true);
+	if (connect(fd, (sockaddr *) &target.addr, sizeof target.addr) < 0 &&
+	    errno != EINPROGRESS) {
+		printf("Unable to connect to %s: %s\n", target.host.c_str(),
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	return fd;
+}
 
-	pollfd entry;
-	entry.events = POLLIN;
-	entry.revents = 0;
-	entry.fd = fd;
-	poll_table.push_back(entry);
-	clients.push_back(client);
+/* Queues our C0+C1 as the connecting side, the signature is not checked */
+void start_handshake(Client *client)
+{
+	client->handshake_state = HANDSHAKE_S0S1S2;
+	client->handshake_sig = (1 + sizeof(Handshake)) *
+		(client->worker->next_sig++ % HANDSHAKE_POOL_LEN);
+	queue_send(client, handshake_pool, client->handshake_sig,
+		   1 + sizeof(Handshake));
+}
 
-	return client;
+/* Waits before connecting again, longer after every failure */
+void retry_relay(Relay *relay)
+{
+	relay->conn = NULL;
+	relay->retry_at = now_us() + relay->backoff;
+	printf("relay of %s from %s failed, retrying in %llu ms\n",
+	       relay->stream->name.c_str(), origin.host.c_str(),
+	       (unsigned long long) relay->backoff / 1000);
+	relay->backoff = std::min<uint64_t>(relay->backoff * 2, RETRY_MAX);
+}
+
+/*
+ * Connects to the origin, unless the stream has got a publisher or lost its
+ * viewers in the meantime. The relay publishes the stream like any local
+ * publisher would. Returns false if the relay is no longer needed.
+ */
+bool connect_relay(Worker *worker, Relay *relay)
+{
+	const std::shared_ptr<Stream> &stream = relay->stream;
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		if (stream->publisher || stream->viewers == 0)
+			return false;
+	}
+
+	int fd = connect_to(origin);
+	Client *client = fd < 0 ? NULL : new_client(worker, fd, CLIENT_RELAY);
+	if (client == NULL) {
+		retry_relay(relay);
+		return true;
+	}
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		if (stream->publisher == NULL) {
+			stream->publisher = client;
+			client->stream = stream;
+			client->publishing = true;
+		}
+	}
+	if (!client->publishing) {
+		/* someone else got there first */
+		close_client(client);
+		return false;
+	}
+	printf("relaying %s from %s\n", stream->name.c_str(),
+	       origin.host.c_str());
+	client->relay = relay;
+	relay->conn = client;
+	client->parser.max_message = max_message_len;
+	client->recv_time = now_us();
+	client->rate_start = 0;
+	client->rate_bytes = 0;
+	client->rate_frames = 0;
+	client->ingest_bitrate = 0;
+	client->ingest_fps = 0;
+	client->keyframe_seen = false;
+	client->keyframe_interval = 0;
+	start_handshake(client);
+	return true;
+}
+
+/* Drops a relay, closing its connection without a retry */
+void stop_relay(Worker *worker, size_t index)
+{
+	Relay *relay = worker->relays[index];
+	if (relay->conn) {
+		relay->conn->relay = NULL;
+		close_client(relay->conn);
+	}
+	delete relay;
+	worker->relays[index] = worker->relays.back();
+	worker->relays.pop_back();
+}
+
+/*
+ * Pulls a stream from the origin, unless it already has a publisher or a
+ * relay on this worker
+ */
+void pull_stream(Worker *worker, const std::shared_ptr<Stream> &stream)
+{
+	for (size_t i = 0; i < worker->relays.size(); ++i) {
+		Relay *relay = worker->relays[i];
+		if (relay->stream != stream)
+			continue;
+		/* a new viewer does not wait for the retry */
+		if (relay->conn == NULL && !connect_relay(worker, relay)) {
+			stop_relay(worker, i);
+		}
+		return;
+	}
+
+	Relay *relay = new Relay;
+	relay->stream = stream;
+	relay->conn = NULL;
+	relay->retry_at = 0;
+	relay->backoff = RETRY_MIN;
+	worker->relays.push_back(relay);
+	if (!connect_relay(worker, relay)) {
+		stop_relay(worker, worker->relays.size() - 1);
+	}
+}
+
+/*
+ * Stops the relays without viewers, once in a while, and the ones the
+ * origin stopped sending to. Reconnects the relays whose wait is over.
+ */
+void check_relays(Worker *worker)
+{
+	if (worker->relays.empty())
+		return;
+	uint64_t now = now_us();
+	bool count = now - worker->relays_checked >= RELAY_CHECK;
+	if (count) {
+		worker->relays_checked = now;
+	}
+	for (size_t i = 0; i < worker->relays.size(); ) {
+		Relay *relay = worker->relays[i];
+		size_t viewers = 1;
+		if (count) {
+			std::lock_guard<std::mutex> lock(registry_lock);
+			viewers = relay->stream->viewers;
+		}
+		if (viewers == 0) {
+			printf("no viewers left, stopping the relay of %s\n",
+			       relay->stream->name.c_str());
+			stop_relay(worker, i);
+			continue;
+		}
+		if (relay->conn && now - relay->conn->recv_time > RELAY_TIMEOUT) {
+			printf("relay of %s stalled\n",
+			       relay->stream->name.c_str());
+			close_client(relay->conn);
+		} else if (relay->conn == NULL && now >= relay->retry_at &&
+			   !connect_relay(worker, relay)) {
+			stop_relay(worker, i);
+			continue;
+		}
+		++i;
+	}
+}
+
+/* Waits before connecting again, longer after every failure */
+void retry_push(Push *push)
+{
+	push->conn = NULL;
+	push->retry_at = now_us() + push->backoff;
+	printf("push of %s to %s failed, retrying in %llu ms\n",
+	       push->stream->name.c_str(), push->target->host.c_str(),
+	       (unsigned long long) push->backoff / 1000);
+	push->backoff = std::min<uint64_t>(push->backoff * 2, RETRY_MAX);
+}
+
+void connect_push(Worker *worker, Push *push)
+{
+	int fd = connect_to(*push->target);
+	Client *client = fd < 0 ? NULL : new_client(worker, fd, CLIENT_PUSH);
+	if (client == NULL) {
+		retry_push(push);
+		return;
+	}
+	client->push = push;
+	push->conn = client;
+	start_handshake(client);
+}
+
+/*
+ * Forwards a stream published on this worker to every push target. Each
+ * target has its own connection, which is a subscriber like any viewer: a
+ * slow target only drops media from its own send queue.
+ */
+void push_stream(Worker *worker, const std::shared_ptr<Stream> &stream)
+{
+	FOR_EACH(std::vector<Target>, i, push_targets) {
+		Push *push = new Push;
+		push->stream = stream;
+		push->target = &*i;
+		push->conn = NULL;
+		push->retry_at = 0;
+		push->backoff = RETRY_MIN;
+		worker->pushes.push_back(push);
+		connect_push(worker, push);
+	}
 }
 
-void close_client(Client *client, size_t i)
+/* Reconnects the pushes whose wait is over */
+void retry_pushes(Worker *worker)
+{
+	uint64_t now = 0;
+	FOR_EACH(std::vector<Push *>, i, worker->pushes) {
+		Push *push = *i;
+		if (push->conn)
+			continue;
+		if (now == 0)
+			now = now_us();
+		if (now >= push->retry_at) {
+			connect_push(worker, push);
+		}
+	}
+}
+
+/*
+ * The epoll timeout, in ms: files are paced, pushes are retried, relays are
+ * checked and held back events are handed over
+ */
+int poll_timeout(Worker *worker)
 {
-	clients.erase(clients.begin() + i);
-	poll_table.erase(poll_table.begin() + i);
+	int timeout = worker->vod_clients.empty() ? -1 : VOD_TICK;
+	if (!worker->relays.empty() &&
+	    (timeout < 0 || timeout > RELAY_CHECK / 1000)) {
+		timeout = RELAY_CHECK / 1000;
+	}
+	FOR_EACH(std::vector<std::deque<StreamEvent> >, i, worker->backlog) {
+		if (!i->empty())
+			return BACKLOG_TICK;
+	}
+	uint64_t now = 0;
+	FOR_EACH(std::vector<Push *>, i, worker->pushes) {
+		Push *push = *i;
+		if (push->conn)
+			continue;
+		if (now == 0)
+			now = now_us();
+		int wait = push->retry_at > now ?
+			(push->retry_at - now + 999) / 1000 : 0;
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+	}
+	return timeout;
+}
+
+void close_client(Client *client)
+{
+	Worker *worker = client->worker;
+
+	/* move the last client in place of the removed one */
+	Client *last = worker->clients.back();
+	worker->clients[client->index] = last;
+	last->index = client->index;
+	worker->clients.pop_back();
+
 	close(client->fd);
+	client->fd = -1;
 
-	if (client == publisher) {
-		printf("publisher disconnected.\n");
-		publisher = NULL;
-		FOR_EACH(std::vector<Client *>, i, clients) {
-			Client *client = *i;
-			if (client != NULL) {
-				client->ready = false;
-			}
+	if (client->publishing) {
+		stop_publishing(client);
+	} else {
+		unsubscribe(client);
+		stop_vod(client);
+	}
+	if (client->push) {
+		retry_push(client->push);
+	}
+	if (client->relay) {
+		retry_relay(client->relay);
+	}
+
+	std::vector<Client *> &scrapers = worker->scrapers;
+	for (size_t i = 0; i < scrapers.size(); ++i) {
+		if (scrapers[i] == client) {
+			scrapers.erase(scrapers.begin() + i);
+			break;
 		}
 	}
 
-	delete client;
+	worker->closed_clients.push_back(client);
 }
 
-void do_poll()
+/* Drops the pushes of a stream that is no longer published */
+void stop_pushes(Worker *worker, const std::shared_ptr<Stream> &stream)
 {
-	for (size_t i = 0; i < poll_table.size(); ++i) {
-		Client *client = clients[i];
-		if (client != NULL) {
-			if (!client->send_queue.empty()) {
-				debug("waiting for pollout\n");
-				poll_table[i].events = POLLIN | POLLOUT;
-			} else {
-				poll_table[i].events = POLLIN;
+	std::vector<Push *> &pushes = worker->pushes;
+	for (size_t i = 0; i < pushes.size(); ) {
+		Push *push = pushes[i];
+		if (push->stream != stream) {
+			++i;
+			continue;
+		}
+		if (push->conn) {
+			/* not to be retried */
+			push->conn->push = NULL;
+			close_client(push->conn);
+		}
+		delete push;
+		pushes[i] = pushes.back();
+		pushes.pop_back();
+	}
+}
+
+void flush_clients(Worker *worker)
+{
+	for (size_t i = 0; i < worker->flush_list.size(); ++i) {
+		Client *client = worker->flush_list[i];
+		client->flush_pending = false;
+		if (client->fd < 0)
+			continue;
+		try {
+			try_to_send(client);
+			if (client->hangup && client->send_queue.empty()) {
+				close_client(client);
+				continue;
+			}
+			if (client->queued - client->burst_left >
+			    max_queue_len * 4) {
+				throw std::runtime_error("send queue overflow");
 			}
+			update_events(client);
+		} catch (const std::runtime_error &e) {
+			printf("client error: %s\n", e.what());
+			close_client(client);
 		}
 	}
+	worker->flush_list.clear();
 
-	if (poll(&poll_table[0], poll_table.size(), -1) < 0) {
+	FOR_EACH(std::vector<Client *>, i, worker->closed_clients) {
+		delete *i;
+	}
+	worker->closed_clients.clear();
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (!worker->wake_pending[i])
+			continue;
+		worker->wake_pending[i] = false;
+		uint64_t one = 1;
+		if (write(workers[i]->event_fd, &one, sizeof one) < 0) {
+			debug("unable to wake worker %zu: %s\n", i,
+			      strerror(errno));
+		}
+	}
+}
+
+void recv_events(Worker *worker)
+{
+	uint64_t count;
+	if (read(worker->event_fd, &count, sizeof count) < 0) {
+		if (errno != EAGAIN) {
+			throw std::runtime_error(strf("unable to read eventfd: %s",
+						      strerror(errno)));
+		}
+	}
+
+	FOR_EACH(std::vector<SPSCQueue<StreamEvent> *>, i, worker->inbox) {
+		SPSCQueue<StreamEvent> *queue = *i;
+		if (queue == NULL)
+			continue;
+		StreamEvent event;
+		while (queue->pop(event)) {
+			handle_stream_event(worker, &event);
+		}
+	}
+
+	uint64_t round = worker->metrics_wanted;
+	if (round != worker->metrics_round) {
+		update_metrics(worker, round);
+		/* the scraping worker is the first one */
+		worker->wake_pending[0] = true;
+	}
+	finish_scrape(worker);
+}
+
+void do_poll(Worker *worker)
+{
+	epoll_event events[64];
+	int count = epoll_wait(worker->epoll_fd, events, 64,
+			       poll_timeout(worker));
+	if (count < 0) {
 		if (errno == EAGAIN || errno == EINTR)
 			return;
-		throw std::runtime_error(strf("poll() failed: %s",
+		throw std::runtime_error(strf("epoll_wait() failed: %s",
 						strerror(errno)));
 	}
+	uint64_t start = now_us();
 
-	for (size_t i = 0; i < poll_table.size(); ++i) {
-		Client *client = clients[i];
-		if (poll_table[i].revents & POLLOUT) {
-			try {
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.ptr == NULL) {
+			accept_clients(worker, worker->listen_fd, CLIENT_RTMP);
+			continue;
+		}
+		if (events[i].data.ptr == &worker->http_fd) {
+			accept_clients(worker, worker->http_fd, CLIENT_HTTP);
+			continue;
+		}
+		if (events[i].data.ptr == &worker->metrics_fd) {
+			accept_clients(worker, worker->metrics_fd,
+				       CLIENT_METRICS);
+			continue;
+		}
+		if (events[i].data.ptr == worker) {
+			recv_events(worker);
+			continue;
+		}
+		Client *client = (Client *) events[i].data.ptr;
+		if (client->fd < 0) {
+			/* closed while handling an earlier event */
+			continue;
+		}
+		try {
+			if (events[i].events & EPOLLOUT) {
 				try_to_send(client);
-			} catch (const std::runtime_error &e) {
-				printf("client error: %s\n", e.what());
-				close_client(client, i);
-				--i;
-				continue;
+				if (client->hangup &&
+				    client->send_queue.empty()) {
+					close_client(client);
+					continue;
+				}
+				update_events(client);
 			}
-		}
-		if (poll_table[i].revents & POLLIN) {
-			if (client == NULL) {
-				new_client();
-			} else try {
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
 				recv_from_client(client);
-			} catch (const std::runtime_error &e) {
-				printf("client error: %s\n", e.what());
-				close_client(client, i);
-				--i;
 			}
+		} catch (const std::runtime_error &e) {
+			printf("client error: %s\n", e.what());
+			close_client(client);
 		}
 	}
+
+	pump_vod(worker);
+	retry_pushes(worker);
+	check_relays(worker);
+	flush_backlog(worker);
+	flush_clients(worker);
+
+	worker->loop_time.observe((now_us() - start) / 1e6);
 }
 
+void add_fd(int epoll_fd, int fd, void *ptr)
+{
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		throw std::runtime_error(strf("epoll_ctl() failed: %s",
+					      strerror(errno)));
+	}
 }
 
-int main()
-try {
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0)
-		return 1;
+int create_listener(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		throw std::runtime_error(strf("Unable to create socket: %s",
+					 strerror(errno)));
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0) {
+		throw std::runtime_error(strf("Unable to set SO_REUSEPORT: %s",
+					 strerror(errno)));
+	}
 
 	sockaddr_in sin;
+	memset(&sin, 0, sizeof sin);
 	sin.sin_family = AF_INET;
-	sin.sin_port = htons(PORT);
+	sin.sin_port = htons(port);
 	sin.sin_addr.s_addr = INADDR_ANY;
-	if (bind(listen_fd, (sockaddr *) &sin, sizeof sin) < 0) {
+	if (bind(fd, (sockaddr *) &sin, sizeof sin) < 0) {
 		throw std::runtime_error(strf("Unable to listen: %s",
 					 strerror(errno)));
-		return 1;
 	}
 
-	listen(listen_fd, 10);
+	listen(fd, 10);
+	set_nonblock(fd, true);
+	return fd;
+}
 
-	pollfd entry;
-	entry.events = POLLIN;
-	entry.revents = 0;
-	entry.fd = listen_fd;
-	poll_table.push_back(entry);
-	clients.push_back(NULL);
+Worker *new_worker(size_t id, size_t num_workers)
+{
+	Worker *worker = new Worker;
+	worker->id = id;
+	worker->next_sig = 0;
+	worker->accepted = 0;
+	worker->bytes_in = 0;
+	worker->bytes_out = 0;
+	worker->dropped = 0;
+	worker->metrics_wanted = 0;
+	worker->metrics_round = 0;
+	worker->scrape_round = 0;
+	worker->relays_checked = 0;
+
+	/* every worker has its own listener, the kernel balances between them */
+	worker->listen_fd = create_listener(listen_port);
+
+	worker->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (worker->event_fd < 0) {
+		throw std::runtime_error(strf("Unable to create eventfd: %s",
+					 strerror(errno)));
+	}
 
-	for (;;) {
-		do_poll();
+	worker->epoll_fd = epoll_create1(0);
+	if (worker->epoll_fd < 0) {
+		throw std::runtime_error(strf("Unable to create epoll: %s",
+					 strerror(errno)));
+	}
+	add_fd(worker->epoll_fd, worker->listen_fd, NULL);
+	add_fd(worker->epoll_fd, worker->event_fd, worker);
+
+	worker->http_fd = -1;
+	if (http_port) {
+		worker->http_fd = create_listener(http_port);
+		add_fd(worker->epoll_fd, worker->http_fd, &worker->http_fd);
+	}
+
+	/* the first worker serves the metrics of all */
+	worker->metrics_fd = -1;
+	if (id == 0 && metrics_port) {
+		worker->metrics_fd = create_listener(metrics_port);
+		add_fd(worker->epoll_fd, worker->metrics_fd,
+		       &worker->metrics_fd);
+	}
+
+	for (size_t i = 0; i < num_workers; ++i) {
+		if (i == id) {
+			/* events from itself are handled directly */
+			worker->inbox.push_back(NULL);
+		} else {
+			worker->inbox.push_back(
+				new SPSCQueue<StreamEvent>(INBOX_LEN));
+		}
+	}
+	worker->wake_pending.resize(num_workers, false);
+	worker->backlog.resize(num_workers);
+
+	return worker;
+}
+
+void run_worker(Worker *worker)
+{
+	try {
+		for (;;) {
+			do_poll(worker);
+		}
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "ERROR: %s\n", e.what());
+		exit(1);
+	}
+}
+
+/* Looks up "host[:port]", once at startup since it may block */
+void resolve(const std::string &host, sockaddr_in *addr)
+{
+	std::string name = host;
+	std::string port = strf("%d", PORT);
+	size_t colon = host.rfind(':');
+	if (colon != std::string::npos) {
+		name = host.substr(0, colon);
+		port = host.substr(colon + 1);
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *res;
+	int err = getaddrinfo(name.c_str(), port.c_str(), &hints, &res);
+	if (err != 0) {
+		throw std::runtime_error(strf("unable to resolve %s: %s",
+					      host.c_str(), gai_strerror(err)));
+	}
+	memcpy(addr, res->ai_addr, sizeof *addr);
+	freeaddrinfo(res);
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p port] [-w workers] [-g gop cache KB] "
+		"[-q queue KB] [-l queue ms] [-m max message KB] "
+		"[-c chunk size] [-r record dir] [-S file MB] "
+		"[-T file seconds] [-v video on demand dir] "
+		"[-M metrics port] [-L trace every nth message] "
+		"[-o origin host[:port]] [-f push target host[:port]]... "
+		"[-H HTTP-FLV port]\n", prog);
+	exit(1);
+}
+
+}
+
+int main(int argc, char **argv)
+try {
+	size_t num_workers = 1;
+	const char *record_dir = NULL;
+	uint64_t record_size = DEFAULT_RECORD_SIZE * 1024 * 1024;
+	unsigned long record_time = DEFAULT_RECORD_TIME;
+
+	int c;
+	while ((c = getopt(argc, argv, "p:w:g:q:l:m:c:r:S:T:v:M:L:o:f:H:")) != -1) {
+		switch (c) {
+		case 'p':
+			listen_port = atoi(optarg);
+			break;
+		case 'w':
+			num_workers = atoi(optarg);
+			if (num_workers < 1 || num_workers > MAX_WORKERS)
+				usage(argv[0]);
+			break;
+		case 'g':
+			gop_cache_len = atoi(optarg) * 1024;
+			break;
+		case 'q':
+			max_queue_len = atoi(optarg) * 1024;
+			break;
+		case 'l':
+			max_queue_time = atoi(optarg);
+			break;
+		case 'm':
+			max_message_len = atoi(optarg) * 1024;
+			break;
+		case 'c':
+			out_chunk_len = atoi(optarg);
+			if (out_chunk_len < DEFAULT_CHUNK_LEN ||
+			    out_chunk_len > MAX_OUT_CHUNK)
+				usage(argv[0]);
+			break;
+		case 'r':
+			record_dir = optarg;
+			break;
+		case 'S':
+			record_size = atoll(optarg) * 1024 * 1024;
+			break;
+		case 'T':
+			record_time = atoi(optarg);
+			break;
+		case 'v':
+			vod_dir = optarg;
+			break;
+		case 'M':
+			metrics_port = atoi(optarg);
+			break;
+		case 'H':
+			http_port = atoi(optarg);
+			break;
+		case 'L':
+			trace_every = atoi(optarg);
+			break;
+		case 'o':
+			origin.host = optarg;
+			break;
+		case 'f': {
+			Target target;
+			target.host = optarg;
+			push_targets.push_back(target);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	init_handshake_pool();
+	init_templates();
+
+	if (!origin.host.empty()) {
+		resolve(origin.host, &origin.addr);
+	}
+	FOR_EACH(std::vector<Target>, i, push_targets) {
+		resolve(i->host, &i->addr);
+	}
+
+	if (record_dir) {
+		recorder = new Recorder(record_dir, record_size, record_time);
+	}
+
+	for (size_t i = 0; i < num_workers; ++i) {
+		workers.push_back(new_worker(i, num_workers));
+	}
+
+	/* the main thread runs the first worker */
+	for (size_t i = 1; i < num_workers; ++i) {
+		std::thread(run_worker, workers[i]).detach();
 	}
+	run_worker(workers[0]);
 	return 0;
 } catch (const std::runtime_error &e) {
 	fprintf(stderr, "ERROR: %s\n", e.what());
@@ -0,0 +1,117 @@
+#include "metrics.h"
+#include "utils.h"
+#include <string.h>
+
+namespace {
+
+const double bucket_bounds[HISTOGRAM_BUCKETS] = {
+	0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005,
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+	0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+}
+
+Histogram::Histogram() :
+	count(0), sum(0), max(0)
+{
+	memset(buckets, 0, sizeof buckets);
+}
+
+void Histogram::observe(double value)
+{
+	int i = 0;
+	while (i < HISTOGRAM_BUCKETS && value > bucket_bounds[i])
+		i++;
+	buckets[i]++;
+	count++;
+	sum += value;
+	if (value > max)
+		max = value;
+}
+
+void Histogram::merge(const Histogram &other)
+{
+	for (int i = 0; i <= HISTOGRAM_BUCKETS; ++i) {
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	sum += other.sum;
+	if (other.max > max)
+		max = other.max;
+}
+
+double Histogram::quantile(double q) const
+{
+	if (count == 0)
+		return 0;
+	/* interpolate within the bucket holding the rank */
+	double rank = q * count;
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		if (buckets[i] > 0 && seen + buckets[i] >= rank) {
+			double low = i ? bucket_bounds[i - 1] : 0;
+			double high = bucket_bounds[i];
+			double value = low + (high - low) *
+				(rank - seen) / buckets[i];
+			return value < max ? value : max;
+		}
+		seen += buckets[i];
+	}
+	return max;
+}
+
+void metric_header(std::string *out, const MetricFamily &family)
+{
+	*out += strf("# HELP %s %s\n# TYPE %s %s\n", family.name, family.help,
+		     family.name, family.type);
+}
+
+std::string metric_label(const char *key, const std::string &value)
+{
+	std::string out = key;
+	out += "=\"";
+	FOR_EACH_CONST(std::string, i, value) {
+		if (*i == '\\' || *i == '"') {
+			out += '\\';
+			out += *i;
+		} else if (*i == '\n') {
+			out += "\\n";
+		} else {
+			out += *i;
+		}
+	}
+	out += '"';
+	return out;
+}
+
+void metric_sample(std::string *out, const char *name,
+		   const std::string &labels, double value)
+{
+	*out += name;
+	if (!labels.empty()) {
+		*out += '{';
+		*out += labels;
+		*out += '}';
+	}
+	*out += strf(" %.15g\n", value);
+}
+
+void metric_histogram(std::string *out, const char *name,
+		      const std::string &labels, const Histogram &hist)
+{
+	std::string prefix = labels.empty() ? "" : labels + ",";
+	std::string bucket = std::string(name) + "_bucket";
+	uint64_t total = 0;
+	for (int i = 0; i <= HISTOGRAM_BUCKETS; ++i) {
+		total += hist.buckets[i];
+		std::string le = i < HISTOGRAM_BUCKETS ?
+			strf("%g", bucket_bounds[i]) : "+Inf";
+		metric_sample(out, bucket.c_str(),
+			      prefix + metric_label("le", le), total);
+	}
+	metric_sample(out, (std::string(name) + "_sum").c_str(), labels,
+		      hist.sum);
+	metric_sample(out, (std::string(name) + "_count").c_str(), labels,
+		      hist.count);
+}
@@ -0,0 +1,48 @@
+#ifndef __metrics_h
+#define __metrics_h
+
+#include <string>
+#include <stdint.h>
+
+/*
+ * Helpers for the Prometheus text format. The samples are rendered into
+ * plain strings, so nothing is allocated until someone asks for them.
+ */
+
+#define HISTOGRAM_BUCKETS	19
+
+/* A histogram of durations in seconds, updated by one thread only */
+struct Histogram {
+	uint64_t buckets[HISTOGRAM_BUCKETS + 1]; /* the last one is +Inf */
+	uint64_t count;
+	double sum;
+	double max;
+
+	Histogram();
+
+	void observe(double value);
+	void merge(const Histogram &other);
+	/* Estimates the value below which the given fraction falls */
+	double quantile(double q) const;
+};
+
+struct MetricFamily {
+	const char *name;
+	const char *type; /* "counter", "gauge" or "histogram" */
+	const char *help;
+};
+
+/* Writes the HELP and TYPE lines that start a family */
+void metric_header(std::string *out, const MetricFamily &family);
+
+/* Formats key="value", escaped as needed */
+std::string metric_label(const char *key, const std::string &value);
+
+void metric_sample(std::string *out, const char *name,
+		   const std::string &labels, double value);
+
+/* Writes the cumulative buckets, sum and count of a histogram */
+void metric_histogram(std::string *out, const char *name,
+		      const std::string &labels, const Histogram &hist);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * RTMPServer microbenchmarks
+ *
+ * Runs the chunk parser, the chunk serializer and the AMF codec on
+ * synthetic or recorded input, without any sockets.
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "amf.h"
+#include "utils.h"
+#include "rtmp.h"
+#include "chunk.h"
+#include "pool.h"
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define MIN_DURATION	500000000	/* ns */
+#define READ_LEN	65536	/* bytes handed to the parser at a time */
+#define STREAM_SECONDS	10
+
+namespace {
+
+struct Message {
+	uint8_t type;
+	uint32_t endpoint;
+	unsigned long timestamp;
+	std::string buf;
+};
+
+/* keeps the compiler from optimizing the work away */
+volatile size_t sink;
+
+uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void report(const std::string &name, uint64_t elapsed, size_t messages,
+	    size_t bytes)
+{
+	printf("%-32s %10.1f ns/msg %10.1f MB/s\n", name.c_str(),
+	       double(elapsed) / messages, bytes * 1e3 / elapsed);
+}
+
+/* Ten seconds of 25 fps video and AAC audio, interleaved by timestamp */
+std::vector<Message> synthetic_stream(size_t video_bitrate)
+{
+	size_t inter_len = video_bitrate * 1000 / 8 / 25 * 50 / 54;
+	std::vector<Message> msgs;
+	unsigned long audio_ts = 0;
+	for (int frame = 0; frame < STREAM_SECONDS * 25; ++frame) {
+		unsigned long ts = frame * 40;
+		while (audio_ts <= ts) {
+			Message msg;
+			msg.type = MSG_AUDIO;
+			msg.endpoint = STREAM_ID;
+			msg.timestamp = audio_ts;
+			msg.buf = std::string(180, 'a');
+			msg.buf[0] = char(FLV_AUDIO_AAC << 4 | 0x0f);
+			msg.buf[1] = 1;
+			msgs.push_back(msg);
+			audio_ts += 23;
+		}
+		bool key = frame % 50 == 0;
+		Message msg;
+		msg.type = MSG_VIDEO;
+		msg.endpoint = STREAM_ID;
+		msg.timestamp = ts;
+		msg.buf = std::string(key ? inter_len * 5 : inter_len, 'v');
+		msg.buf[0] = char((key ? FLV_KEY_FRAME : FLV_INTER_FRAME) << 4 |
+				  FLV_CODEC_AVC);
+		msg.buf[1] = 1;
+		msgs.push_back(msg);
+	}
+	return msgs;
+}
+
+/* Serializes messages the way the server sends them to one client */
+std::string serialize(const std::vector<Message> &msgs, size_t chunk_len)
+{
+	ChunkStream streams[64];
+	for (int i = 0; i < 64; ++i) {
+		streams[i].valid = false;
+	}
+
+	std::string out;
+	std::vector<Message> all;
+	Message set_chunk;
+	set_chunk.type = MSG_SET_CHUNK;
+	set_chunk.endpoint = CONTROL_ID;
+	set_chunk.timestamp = 0;
+	uint32_t len = htonl(chunk_len);
+	set_chunk.buf.assign((char *) &len, 4);
+	all.push_back(set_chunk);
+	all.insert(all.end(), msgs.begin(), msgs.end());
+
+	FOR_EACH_CONST(std::vector<Message>, i, all) {
+		int channel_num = i->endpoint == STREAM_ID ? CHAN_STREAM :
+				  CHAN_CONTROL;
+		char header[MAX_CHUNK_HEADER];
+		size_t header_len = chunk_header(&streams[channel_num], header,
+						 channel_num, i->type,
+						 i->endpoint, i->buf.size(),
+						 i->timestamp);
+		out.append(header, header_len);
+		out += chunk_body(i->buf, channel_num, chunk_len);
+	}
+	return out;
+}
+
+/* Audio frames of equal length, which repeat the header with fmt 3 */
+std::vector<Message> audio_run()
+{
+	std::vector<Message> msgs;
+	for (int i = 0; i < 5; ++i) {
+		Message msg;
+		msg.type = MSG_AUDIO;
+		msg.endpoint = STREAM_ID;
+		msg.timestamp = 1000 + i * 23;
+		msg.buf = std::string(180, 'a');
+		msgs.push_back(msg);
+	}
+	return msgs;
+}
+
+/* Parses the serialized messages back and compares them to the originals */
+void check_roundtrip(const std::string &name,
+		     const std::vector<Message> &msgs, size_t chunk_len)
+{
+	std::string wire = serialize(msgs, chunk_len);
+	ChunkParser parser;
+	parser.max_message = 64 * 1024 * 1024;
+	RingBuffer in(2 * READ_LEN);
+	size_t pos = 0, n = 0;
+	bool set_chunk = false;
+	while (pos < wire.size()) {
+		iovec iov[2];
+		int count = in.free_space(iov);
+		for (int i = 0; i < count && pos < wire.size(); ++i) {
+			size_t len = std::min(iov[i].iov_len, wire.size() - pos);
+			memcpy(iov[i].iov_base, &wire[pos], len);
+			in.produce(len);
+			pos += len;
+		}
+		while (RTMP_Message *msg = parser.next(&in)) {
+			if (!set_chunk) {
+				/* the first message sets our chunk size */
+				parser.chunk_len = load_be32(msg->buf.data());
+				set_chunk = true;
+				continue;
+			}
+			if (n >= msgs.size()) {
+				throw std::runtime_error(strf("%s: too many messages",
+							      name.c_str()));
+			}
+			const Message &orig = msgs[n];
+			if (msg->type != orig.type ||
+			    msg->endpoint != orig.endpoint ||
+			    msg->timestamp != orig.timestamp ||
+			    msg->buf != orig.buf) {
+				throw std::runtime_error(strf("%s: message %zu (ts %lu) parsed as type %d, ts %lu",
+							      name.c_str(), n,
+							      orig.timestamp,
+							      msg->type,
+							      msg->timestamp));
+			}
+			n++;
+		}
+	}
+	if (n != msgs.size()) {
+		throw std::runtime_error(strf("%s: %zu of %zu messages parsed",
+					      name.c_str(), n, msgs.size()));
+	}
+}
+
+/* Feeds the wire data to a parser in read-sized pieces */
+void bench_parse(const std::string &name, const std::string &wire)
+{
+	size_t messages = 0, bytes = 0;
+	uint64_t start = now_ns(), elapsed;
+	do {
+		ChunkParser parser;
+		parser.max_message = 64 * 1024 * 1024;
+		RingBuffer in(2 * READ_LEN);
+		size_t pos = 0;
+		while (pos < wire.size()) {
+			iovec iov[2];
+			int count = in.free_space(iov);
+			for (int i = 0; i < count && pos < wire.size(); ++i) {
+				size_t len = std::min(iov[i].iov_len,
+						      wire.size() - pos);
+				len = std::min(len, size_t(READ_LEN));
+				memcpy(iov[i].iov_base, &wire[pos], len);
+				in.produce(len);
+				pos += len;
+			}
+			while (RTMP_Message *msg = parser.next(&in)) {
+				if (msg->type == MSG_SET_CHUNK &&
+				    msg->buf.size() >= 4) {
+					parser.chunk_len =
+						load_be32(msg->buf.data());
+				}
+				sink += msg->buf.size();
+				messages++;
+			}
+		}
+		bytes += wire.size();
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_DURATION);
+	report(name, elapsed, messages, bytes);
+}
+
+void bench_serialize(const std::string &name,
+		     const std::vector<Message> &msgs, size_t chunk_len)
+{
+	ChunkStream streams[64];
+	for (int i = 0; i < 64; ++i) {
+		streams[i].valid = false;
+	}
+	size_t messages = 0, bytes = 0;
+	uint64_t start = now_ns(), elapsed;
+	do {
+		FOR_EACH_CONST(std::vector<Message>, i, msgs) {
+			char header[MAX_CHUNK_HEADER];
+			size_t len = chunk_header(&streams[CHAN_STREAM], header,
+						  CHAN_STREAM, i->type,
+						  i->endpoint, i->buf.size(),
+						  i->timestamp);
+			std::string body = chunk_body(i->buf, CHAN_STREAM,
+						      chunk_len);
+			bytes += len + body.size();
+			pool_free(body);
+		}
+		messages += msgs.size();
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_DURATION);
+	sink += bytes;
+	report(name, elapsed, messages, bytes);
+}
+
+std::string connect_payload()
+{
+	Arena arena;
+	Encoder enc;
+	amf_write(&enc, "connect");
+	amf_write(&enc, 1.0);
+	amf_write(&enc, AMFValue::object(&arena, {
+		{"app", "live"},
+		{"flashVer", "FMLE/3.0 (compatible; FMSc/1.0)"},
+		{"swfUrl", "rtmp://localhost/live"},
+		{"tcUrl", "rtmp://localhost/live"},
+		{"fpad", false},
+		{"capabilities", 239.0},
+		{"audioCodecs", 3575.0},
+		{"videoCodecs", 252.0},
+		{"videoFunction", 1.0},
+		{"pageUrl", "http://localhost/player.html"},
+		{"objectEncoding", 0.0},
+	}));
+	return enc.buf;
+}
+
+std::string metadata_payload()
+{
+	Arena arena;
+	Encoder enc;
+	amf_write(&enc, "@setDataFrame");
+	amf_write(&enc, "onMetaData");
+	amf_write(&enc, AMFValue::object(&arena, {
+		{"duration", 0.0},
+		{"width", 1280.0},
+		{"height", 720.0},
+		{"videodatarate", 2500.0},
+		{"framerate", 25.0},
+		{"videocodecid", 7.0},
+		{"audiodatarate", 128.0},
+		{"audiosamplerate", 44100.0},
+		{"audiosamplesize", 16.0},
+		{"stereo", true},
+		{"audiocodecid", 10.0},
+		{"major_brand", "isom"},
+		{"minor_version", "512"},
+		{"compatible_brands", "isomiso2avc1mp41"},
+		{"encoder", "Lavf58.29.100"},
+		{"filesize", 0.0},
+	}, AMF_ECMA_ARRAY));
+	return enc.buf;
+}
+
+/* Decodes all values of a command, and optionally encodes them again */
+void bench_amf(const std::string &name, const std::string &payload,
+	       bool encode)
+{
+	size_t messages = 0;
+	uint64_t start = now_ns(), elapsed;
+	do {
+		Arena arena;
+		Decoder dec;
+		dec.version = 0;
+		dec.buf = payload;
+		dec.pos = 0;
+		dec.arena = &arena;
+		Encoder enc;
+		while (dec.pos < payload.size()) {
+			AMFValue value = amf_load(&dec);
+			if (encode) {
+				amf_write(&enc, value);
+			}
+		}
+		sink += enc.buf.size();
+		messages++;
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_DURATION);
+	report(name, elapsed, messages, payload.size() * messages);
+}
+
+std::string read_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		throw std::runtime_error(strf("unable to open %s", path));
+	}
+	std::string data;
+	char buf[65536];
+	size_t got;
+	while ((got = fread(buf, 1, sizeof buf, f)) > 0) {
+		data.append(buf, got);
+	}
+	fclose(f);
+	return data;
+}
+
+}
+
+/*
+ * Any arguments are files with a recorded chunk stream, as sent by a
+ * client after the handshake. With -c, only checks that the serialized
+ * messages parse back unchanged.
+ */
+int main(int argc, char **argv)
+try {
+	static const size_t chunk_lens[] = {128, 1024, 4096, 65536};
+
+	std::vector<Message> msgs = synthetic_stream(2000);
+	std::vector<Message> audio = audio_run();
+	for (size_t i = 0; i < sizeof chunk_lens / sizeof chunk_lens[0]; ++i) {
+		check_roundtrip(strf("stream, chunk %zu", chunk_lens[i]),
+				msgs, chunk_lens[i]);
+		check_roundtrip(strf("audio, chunk %zu", chunk_lens[i]),
+				audio, chunk_lens[i]);
+	}
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		printf("round trip OK\n");
+		return 0;
+	}
+
+	for (size_t i = 0; i < sizeof chunk_lens / sizeof chunk_lens[0]; ++i) {
+		bench_parse(strf("parse, chunk %zu", chunk_lens[i]),
+			    serialize(msgs, chunk_lens[i]));
+	}
+	for (size_t i = 0; i < sizeof chunk_lens / sizeof chunk_lens[0]; ++i) {
+		bench_serialize(strf("serialize, chunk %zu", chunk_lens[i]),
+				msgs, chunk_lens[i]);
+	}
+
+	std::string connect = connect_payload();
+	std::string metadata = metadata_payload();
+	bench_amf("amf decode connect", connect, false);
+	bench_amf("amf decode+encode connect", connect, true);
+	bench_amf("amf decode onMetaData", metadata, false);
+	bench_amf("amf decode+encode onMetaData", metadata, true);
+
+	for (int i = 1; i < argc; ++i) {
+		bench_parse(strf("parse %s", argv[i]), read_file(argv[i]));
+	}
+	return 0;
+} catch (const std::runtime_error &e) {
+	fprintf(stderr, "ERROR: %s\n", e.what());
+	return 1;
+}
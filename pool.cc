@@ -0,0 +1,76 @@
+#include "pool.h"
+#include <vector>
+
+#define MIN_CLASS	8	/* 256 bytes */
+#define NUM_CLASSES	17	/* up to 16 MB */
+#define MAX_FREE	32	/* buffers kept per class */
+#define MAX_POOL_BYTES	(32 * 1024 * 1024)
+
+namespace {
+
+struct Pool {
+	std::vector<std::string> free[NUM_CLASSES];
+	size_t bytes;
+};
+
+thread_local Pool pool;
+
+struct PoolDeleter {
+	void operator () (const std::string *buf) const
+	{
+		std::string *s = const_cast<std::string *>(buf);
+		pool_free(*s);
+		delete s;
+	}
+};
+
+}
+
+std::string pool_alloc(size_t len)
+{
+	int c = 0;
+	while ((size_t(1) << (c + MIN_CLASS)) < len)
+		c++;
+
+	std::string buf;
+	if (c >= NUM_CLASSES) {
+		buf.reserve(len);
+		return buf;
+	}
+	if (!pool.free[c].empty()) {
+		buf = std::move(pool.free[c].back());
+		pool.free[c].pop_back();
+		pool.bytes -= buf.capacity();
+		return buf;
+	}
+	buf.reserve(size_t(1) << (c + MIN_CLASS));
+	return buf;
+}
+
+void pool_free(std::string &buf)
+{
+	size_t cap = buf.capacity();
+	buf.clear();
+	if (cap < (size_t(1) << MIN_CLASS)) {
+		/* small buffers are not worth pooling */
+		return;
+	}
+
+	int c = 0;
+	while ((size_t(1) << (c + 1 + MIN_CLASS)) <= cap)
+		c++;
+	if (c >= NUM_CLASSES || pool.free[c].size() >= MAX_FREE ||
+	    pool.bytes + cap > MAX_POOL_BYTES) {
+		std::string().swap(buf);
+		return;
+	}
+	pool.bytes += cap;
+	pool.free[c].push_back(std::move(buf));
+	buf = std::string();
+}
+
+shared_buf_t pool_share(std::string &buf)
+{
+	return std::shared_ptr<const std::string>(
+		new std::string(std::move(buf)), PoolDeleter());
+}
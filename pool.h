@@ -0,0 +1,28 @@
+#ifndef __pool_h
+#define __pool_h
+
+#include <string>
+#include <memory>
+
+/*
+ * Size-classed pool of message buffers. Each thread has its own pool, so
+ * no locking is needed; a buffer released on another thread simply ends up
+ * in that thread's pool.
+ */
+
+/* Returns an empty buffer with room for at least len bytes */
+std::string pool_alloc(size_t len);
+
+/* Takes the storage of the buffer back to the pool, leaving it empty */
+void pool_free(std::string &buf);
+
+/* Immutable bytes that can be queued to many clients at once */
+typedef std::shared_ptr<const std::string> shared_buf_t;
+
+/*
+ * Moves the buffer into an immutable shared buffer, which is returned to
+ * the pool once the last reference is dropped.
+ */
+shared_buf_t pool_share(std::string &buf);
+
+#endif
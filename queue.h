@@ -0,0 +1,58 @@
+#ifndef __queue_h
+#define __queue_h
+
+#include <vector>
+#include <atomic>
+#include <stddef.h>
+
+#define CACHE_LINE	64
+
+/*
+ * Bounded lock-free queue between exactly one producer thread and one
+ * consumer thread. push() fails instead of blocking when the queue is full.
+ */
+template<class T>
+class SPSCQueue {
+public:
+	SPSCQueue(size_t size) :
+		m_items(size + 1), m_head(0), m_tail(0)
+	{
+	}
+
+	bool push(const T &item)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t next = (tail + 1) % m_items.size();
+		if (next == m_head.load(std::memory_order_acquire))
+			return false;
+		m_items[tail] = item;
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+		item = m_items[head];
+		/* drop the reference held by the slot */
+		m_items[head] = T();
+		m_head.store((head + 1) % m_items.size(),
+			     std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> m_items;
+	/* keep the indices on separate cache lines */
+	char m_pad1[CACHE_LINE];
+	std::atomic<size_t> m_head;
+	char m_pad2[CACHE_LINE];
+	std::atomic<size_t> m_tail;
+
+	SPSCQueue(const SPSCQueue &);
+	void operator = (const SPSCQueue &);
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include "recorder.h"
+#include "flv.h"
+#include "rtmp.h"
+#include "utils.h"
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define WRITE_BLOCK	(1024 * 1024)
+#define MAX_PENDING	(64 * 1024 * 1024)	/* queued, not yet handled */
+#define FLUSH_INTERVAL	1	/* s */
+
+class Recording {
+public:
+	Recording(const std::string &name_) :
+		name(name_), fd(-1), size(0), start_ts(0), flushed(0),
+		has_video(false), active(false), failed(false),
+		skip_video(false)
+	{
+	}
+
+	const std::string name;
+	int fd;
+	std::string buf; /* FLV tags waiting to be written */
+	uint64_t size; /* of the current file */
+	unsigned long start_ts; /* stream timestamp at the start of the file */
+	time_t flushed;
+	bool has_video;
+	bool active; /* in the writer's list */
+	bool failed;
+	/* repeated at the start of every file */
+	shared_buf_t metadata;
+	shared_buf_t video_header;
+	shared_buf_t audio_header;
+	/* dropping video until the next keyframe, guarded by the queue lock */
+	bool skip_video;
+};
+
+namespace {
+
+/* Makes a stream name usable as a file name */
+std::string file_name(const std::string &name)
+{
+	std::string out = name;
+	FOR_EACH(std::string, i, out) {
+		char c = *i;
+		if (!isalnum(c) && c != '-' && c != '.')
+			*i = '_';
+	}
+	return out;
+}
+
+}
+
+Recorder::Recorder(const std::string &dir, uint64_t max_size,
+		   unsigned long max_duration) :
+	m_dir(dir), m_max_size(max_size), m_max_duration(max_duration),
+	m_pending(0), m_dropped(0)
+{
+	if (access(dir.c_str(), W_OK) < 0) {
+		throw std::runtime_error(strf("unable to record to %s: %s",
+					      dir.c_str(), strerror(errno)));
+	}
+	std::thread(&Recorder::run, this).detach();
+}
+
+std::shared_ptr<Recording> Recorder::open(const std::string &name)
+{
+	return std::make_shared<Recording>(name);
+}
+
+void Recorder::write(const std::shared_ptr<Recording> &rec, uint8_t type,
+		     unsigned long timestamp, const shared_buf_t &buf)
+{
+	Job job;
+	job.rec = rec;
+	job.type = type;
+	job.timestamp = timestamp;
+	job.buf = buf;
+	push(job);
+}
+
+void Recorder::close(const std::shared_ptr<Recording> &rec)
+{
+	Job job;
+	job.rec = rec;
+	job.type = 0;
+	job.timestamp = 0;
+	push(job);
+}
+
+void Recorder::push(const Job &job)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (job.buf) {
+		/* metadata and sequence headers are small, and always kept */
+		const std::string &buf = *job.buf;
+		bool media = job.type != MSG_NOTIFY &&
+			     !flv_is_sequence_header(job.type, buf.data(),
+						     buf.size());
+		Recording *rec = job.rec.get();
+		if (media && job.type == MSG_VIDEO &&
+		    flv_is_keyframe(job.type, buf.data(), buf.size())) {
+			rec->skip_video = false;
+		}
+		if (media && (m_pending + buf.size() > MAX_PENDING ||
+			      (job.type == MSG_VIDEO && rec->skip_video))) {
+			/* the disk can not keep up */
+			if (job.type == MSG_VIDEO) {
+				rec->skip_video = true;
+			}
+			if (m_dropped++ % 1000 == 0) {
+				printf("recorder falling behind, %llu messages "
+				       "dropped\n", (unsigned long long) m_dropped);
+			}
+			return;
+		}
+		m_pending += buf.size();
+	}
+	if (m_jobs.empty()) {
+		m_cond.notify_one();
+	}
+	m_jobs.push_back(job);
+}
+
+void Recorder::run()
+{
+	std::vector<Job> jobs;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			if (m_jobs.empty()) {
+				m_cond.wait_for(lock,
+					std::chrono::seconds(FLUSH_INTERVAL));
+			}
+			jobs.swap(m_jobs);
+			m_pending = 0;
+		}
+
+		FOR_EACH(std::vector<Job>, i, jobs) {
+			handle(*i);
+		}
+		jobs.clear();
+
+		/* write out what has been collected for a while */
+		time_t now = time(NULL);
+		FOR_EACH(std::vector<std::shared_ptr<Recording> >, i, m_active) {
+			Recording *rec = i->get();
+			if (!rec->buf.empty() &&
+			    now - rec->flushed >= FLUSH_INTERVAL) {
+				flush(rec);
+			}
+		}
+	}
+}
+
+void Recorder::handle(const Job &job)
+{
+	Recording *rec = job.rec.get();
+	if (job.type == 0) {
+		close_file(rec);
+		if (rec->active) {
+			for (size_t i = 0; i < m_active.size(); ++i) {
+				if (m_active[i] == job.rec) {
+					m_active[i] = m_active.back();
+					m_active.pop_back();
+					break;
+				}
+			}
+			rec->active = false;
+		}
+		return;
+	}
+	if (rec->failed)
+		return;
+	if (!rec->active) {
+		m_active.push_back(job.rec);
+		rec->active = true;
+	}
+
+	const std::string &buf = *job.buf;
+	if (job.type == MSG_NOTIFY) {
+		rec->metadata = job.buf;
+	} else if (flv_is_sequence_header(job.type, buf.data(), buf.size())) {
+		if (job.type == MSG_VIDEO) {
+			rec->video_header = job.buf;
+		} else {
+			rec->audio_header = job.buf;
+		}
+	} else {
+		/* start files at keyframes, unless there is no video */
+		bool start =
+			flv_is_keyframe(job.type, buf.data(), buf.size()) ||
+			(job.type == MSG_AUDIO && !rec->has_video);
+		if (job.type == MSG_VIDEO) {
+			rec->has_video = true;
+		}
+		long duration = job.timestamp - rec->start_ts;
+		if (start && (rec->fd < 0 || rec->size >= m_max_size ||
+			      duration < 0 ||
+			      (unsigned long) duration >= m_max_duration * 1000)) {
+			start_file(rec, job.timestamp);
+		}
+	}
+	if (rec->fd < 0)
+		return;
+
+	unsigned long timestamp = 0;
+	if (job.timestamp > rec->start_ts) {
+		timestamp = job.timestamp - rec->start_ts;
+	}
+	size_t len = rec->buf.size();
+	flv_append_tag(&rec->buf, job.type, timestamp, buf);
+	rec->size += rec->buf.size() - len;
+	if (rec->buf.size() >= WRITE_BLOCK) {
+		flush(rec);
+	}
+}
+
+void Recorder::start_file(Recording *rec, unsigned long timestamp)
+{
+	close_file(rec);
+
+	char stamp[32];
+	time_t now = time(NULL);
+	struct tm tm;
+	strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S",
+		 localtime_r(&now, &tm));
+	std::string base = m_dir + "/" + file_name(rec->name) + "-" + stamp;
+	std::string path = base + ".flv";
+	for (int i = 1; ; ++i) {
+		rec->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL,
+				 0644);
+		if (rec->fd >= 0 || errno != EEXIST)
+			break;
+		/* rotated twice within a second */
+		path = strf("%s-%d.flv", base.c_str(), i);
+	}
+	if (rec->fd < 0) {
+		printf("unable to create %s: %s\n", path.c_str(),
+		       strerror(errno));
+		rec->failed = true;
+		return;
+	}
+	printf("recording %s to %s\n", rec->name.c_str(), path.c_str());
+
+	rec->buf += flv_file_header();
+	if (rec->metadata) {
+		flv_append_tag(&rec->buf, MSG_NOTIFY, 0, *rec->metadata);
+	}
+	if (rec->video_header) {
+		flv_append_tag(&rec->buf, MSG_VIDEO, 0, *rec->video_header);
+	}
+	if (rec->audio_header) {
+		flv_append_tag(&rec->buf, MSG_AUDIO, 0, *rec->audio_header);
+	}
+	rec->size = rec->buf.size();
+	rec->start_ts = timestamp;
+	rec->flushed = now;
+}
+
+void Recorder::flush(Recording *rec)
+{
+	rec->flushed = time(NULL);
+	if (rec->fd < 0) {
+		rec->buf.clear();
+		return;
+	}
+	size_t pos = 0;
+	while (pos < rec->buf.size()) {
+		ssize_t written = ::write(rec->fd, &rec->buf[pos],
+					  rec->buf.size() - pos);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("unable to record %s: %s\n", rec->name.c_str(),
+			       strerror(errno));
+			::close(rec->fd);
+			rec->fd = -1;
+			rec->failed = true;
+			break;
+		}
+		pos += written;
+	}
+	rec->buf.clear();
+}
+
+void Recorder::close_file(Recording *rec)
+{
+	if (rec->fd < 0)
+		return;
+	flush(rec);
+	if (rec->fd >= 0) {
+		::close(rec->fd);
+		rec->fd = -1;
+	}
+}
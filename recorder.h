@@ -0,0 +1,64 @@
+#ifndef __recorder_h
+#define __recorder_h
+
+#include "pool.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+/* A stream being recorded, mostly touched by the writer thread only */
+class Recording;
+
+/*
+ * Writes published streams into FLV files. The workers only queue the
+ * messages; a writer thread turns them into FLV tags and writes them out
+ * in large blocks, so a slow disk never blocks the event loops. A new file
+ * is started at a keyframe once the current one is too large or too long.
+ */
+class Recorder {
+public:
+	Recorder(const std::string &dir, uint64_t max_size,
+		 unsigned long max_duration);
+
+	std::shared_ptr<Recording> open(const std::string &name);
+	/* Queues a MSG_AUDIO, MSG_VIDEO or MSG_NOTIFY message */
+	void write(const std::shared_ptr<Recording> &rec, uint8_t type,
+		   unsigned long timestamp, const shared_buf_t &buf);
+	void close(const std::shared_ptr<Recording> &rec);
+
+private:
+	struct Job {
+		std::shared_ptr<Recording> rec;
+		uint8_t type; /* 0 to close */
+		unsigned long timestamp;
+		shared_buf_t buf;
+	};
+
+	std::string m_dir;
+	uint64_t m_max_size;
+	unsigned long m_max_duration;
+
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::vector<Job> m_jobs;
+	size_t m_pending; /* bytes in m_jobs */
+	uint64_t m_dropped;
+
+	/* used by the writer thread only */
+	std::vector<std::shared_ptr<Recording> > m_active;
+
+	void push(const Job &job);
+	void run();
+	void handle(const Job &job);
+	void start_file(Recording *rec, unsigned long timestamp);
+	void flush(Recording *rec);
+	void close_file(Recording *rec);
+
+	Recorder(const Recorder &);
+	void operator = (const Recorder &);
+};
+
+#endif
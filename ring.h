@@ -0,0 +1,95 @@
+#ifndef __ring_h
+#define __ring_h
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Byte ring buffer for received data. Reads go straight into the free space
+ * (which may be split in two by the wrap-around), and the parser consumes
+ * from the front without moving the remaining data. The size is a power of
+ * two, and can grow when the peer keeps filling it.
+ */
+class RingBuffer {
+public:
+	RingBuffer(size_t size = 4096) :
+		m_buf(size), m_head(0), m_tail(0)
+	{
+	}
+
+	size_t size() const { return m_tail - m_head; }
+	size_t capacity() const { return m_buf.size(); }
+	bool empty() const { return m_head == m_tail; }
+
+	/* Describes the free space, returns the number of iovecs used */
+	int free_space(iovec *iov)
+	{
+		size_t mask = m_buf.size() - 1;
+		size_t space = m_buf.size() - size();
+		if (space == 0)
+			return 0;
+		size_t start = m_tail & mask;
+		size_t first = m_buf.size() - start;
+		if (first > space)
+			first = space;
+		iov[0].iov_base = &m_buf[start];
+		iov[0].iov_len = first;
+		if (first == space)
+			return 1;
+		iov[1].iov_base = &m_buf[0];
+		iov[1].iov_len = space - first;
+		return 2;
+	}
+
+	/* Marks bytes written to the free space as filled */
+	void produce(size_t len) { m_tail += len; }
+	void consume(size_t len) { m_head += len; }
+
+	uint8_t at(size_t pos) const
+	{
+		return m_buf[(m_head + pos) & (m_buf.size() - 1)];
+	}
+
+	void copy(size_t pos, void *dst, size_t len) const
+	{
+		size_t mask = m_buf.size() - 1;
+		size_t start = (m_head + pos) & mask;
+		size_t first = m_buf.size() - start;
+		if (first > len)
+			first = len;
+		memcpy(dst, &m_buf[start], first);
+		memcpy((uint8_t *) dst + first, &m_buf[0], len - first);
+	}
+
+	void append_to(std::string &dst, size_t pos, size_t len) const
+	{
+		size_t mask = m_buf.size() - 1;
+		size_t start = (m_head + pos) & mask;
+		size_t first = m_buf.size() - start;
+		if (first > len)
+			first = len;
+		dst.append((const char *) &m_buf[start], first);
+		dst.append((const char *) &m_buf[0], len - first);
+	}
+
+	/* Doubles the size, keeping the data */
+	void grow()
+	{
+		std::vector<uint8_t> buf(m_buf.size() * 2);
+		size_t len = size();
+		copy(0, &buf[0], len);
+		m_buf.swap(buf);
+		m_head = 0;
+		m_tail = len;
+	}
+
+private:
+	std::vector<uint8_t> m_buf;
+	size_t m_head;
+	size_t m_tail;
+};
+
+#endif
@@ -4,6 +4,11 @@
 #define PORT	1935
 
 #define DEFAULT_CHUNK_LEN	128
+#define DEFAULT_WINDOW		2500000
+
+#define PEER_BW_HARD		0
+#define PEER_BW_SOFT		1
+#define PEER_BW_DYNAMIC		2
 
 #define PACKED	__attribute__((packed))
 
@@ -14,8 +19,8 @@
 #define MSG_SET_CHUNK		0x01
 #define MSG_BYTES_READ		0x03
 #define MSG_USER_CONTROL	0x04
-#define MSG_RESPONSE		0x05
-#define MSG_REQUEST		0x06
+#define MSG_WINDOW_ACK_SIZE	0x05
+#define MSG_SET_PEER_BW		0x06
 #define MSG_AUDIO		0x08
 #define MSG_VIDEO		0x09
 #define MSG_INVOKE3		0x11	/* AMF3 */
@@ -30,6 +35,7 @@
 #define CONTROL_BUFFER_TIME	0x03
 #define CONTROL_RESET_STREAM	0x04
 #define CONTROL_PING		0x06
+#define CONTROL_PONG		0x07
 #define CONTROL_REQUEST_VERIFY	0x1a
 #define CONTROL_RESPOND_VERIFY	0x1b
 #define CONTROL_BUFFER_EMPTY	0x1f
@@ -45,6 +51,10 @@
 #define FLV_KEY_FRAME		0x01
 #define FLV_INTER_FRAME		0x02
 
+#define FLV_CODEC_AVC		0x07
+#define FLV_AUDIO_AAC		0x0a
+#define FLV_SEQUENCE_HEADER	0x00	/* AVC/AAC packet type */
+
 struct Handshake {
 	uint8_t flags[8];
 	uint8_t random[RANDOM_LEN];
@@ -0,0 +1,617 @@
+/*
+ * RTMPServer load tool
+ *
+ * Publishes a synthetic stream to the server and plays it back with many
+ * viewers over loopback, measuring throughput and delivery latency.
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "amf.h"
+#include "utils.h"
+#include "rtmp.h"
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define PUBLISH_CHUNK_LEN	65536
+#define FRAME_RATE		25
+#define GOP_LEN			50	/* frames */
+#define AUDIO_INTERVAL		23	/* ms */
+#define AUDIO_FRAME_LEN		180
+#define TIME_OFFSET		5	/* of the send time in a video frame */
+
+namespace {
+
+struct Options {
+	const char *host;
+	int port;
+	std::string app;
+	std::string stream;
+	size_t viewers;
+	unsigned long bitrate; /* kbit/s */
+	unsigned long duration; /* seconds */
+	unsigned long join_delay; /* seconds published before the viewers join */
+	int server_pid;
+};
+
+/* State of an incoming chunk stream */
+struct InChunk {
+	uint8_t type;
+	size_t len;
+	size_t pos; /* received bytes of the current message */
+	uint32_t timestamp;
+	uint32_t delta;
+	bool extended;
+	char head[16]; /* first bytes of the current message */
+};
+
+struct Viewer {
+	int fd;
+	std::string buf; /* received, not yet parsed */
+	size_t chunk_len;
+	InChunk chunks[64];
+	InChunk *chunk; /* chunk stream of the chunk being received */
+	size_t chunk_left;
+	uint64_t bytes;
+	uint64_t frames;
+	bool video_seen;
+	uint32_t video_ts; /* of the last video frame */
+	uint32_t max_gap; /* ms between consecutive video frames */
+};
+
+Options opts;
+std::atomic<bool> running(true);
+std::atomic<uint64_t> measure_start(0);
+
+uint64_t now_us()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void write_all(int fd, const std::string &data)
+{
+	size_t pos = 0;
+	while (pos < data.size()) {
+		ssize_t written = write(fd, &data[pos], data.size() - pos);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(strf("write() failed: %s",
+						      strerror(errno)));
+		}
+		pos += written;
+	}
+}
+
+void read_all(int fd, void *buf, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t got = read(fd, (char *) buf + pos, len - pos);
+		if (got == 0) {
+			throw std::runtime_error("EOF from the server");
+		} else if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(strf("read() failed: %s",
+						      strerror(errno)));
+		}
+		pos += got;
+	}
+}
+
+/* Serializes a message with a full header and continuation chunks */
+std::string chunk_message(int channel_num, uint8_t type, uint32_t endpoint,
+			  unsigned long timestamp, const std::string &buf,
+			  size_t chunk_len)
+{
+	RTMP_Header header;
+	header.flags = channel_num & 0x3f;
+	header.msg_type = type;
+	set_be24(header.timestamp, timestamp);
+	set_be24(header.msg_len, buf.size());
+	set_le32(header.endpoint, endpoint);
+
+	std::string out((char *) &header, sizeof header);
+	size_t pos = 0;
+	while (pos < buf.size()) {
+		if (pos) {
+			out += char((channel_num & 0x3f) | (3 << 6));
+		}
+		size_t chunk = std::min(buf.size() - pos, chunk_len);
+		out.append(buf, pos, chunk);
+		pos += chunk;
+	}
+	return out;
+}
+
+void send_invoke(int fd, uint32_t endpoint, const Encoder &invoke)
+{
+	write_all(fd, chunk_message(CHAN_RESULT, MSG_INVOKE, endpoint, 0,
+				    invoke.buf, DEFAULT_CHUNK_LEN));
+}
+
+/* Connects and runs the plaintext handshake */
+int connect_server()
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		throw std::runtime_error(strf("socket() failed: %s",
+					      strerror(errno)));
+	}
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opts.port);
+	if (inet_pton(AF_INET, opts.host, &sin.sin_addr) != 1) {
+		throw std::runtime_error(strf("invalid address: %s",
+					      opts.host));
+	}
+	if (connect(fd, (sockaddr *) &sin, sizeof sin) < 0) {
+		throw std::runtime_error(strf("unable to connect: %s",
+					      strerror(errno)));
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+	Handshake clientsig;
+	memset(&clientsig, 0, sizeof clientsig);
+	for (int i = 0; i < RANDOM_LEN; ++i) {
+		clientsig.random[i] = rand();
+	}
+	std::string c0c1(1, char(HANDSHAKE_PLAINTEXT));
+	c0c1.append((char *) &clientsig, sizeof clientsig);
+	write_all(fd, c0c1);
+
+	uint8_t s0;
+	Handshake serversig, reply;
+	read_all(fd, &s0, 1);
+	read_all(fd, &serversig, sizeof serversig);
+	write_all(fd, std::string((char *) &serversig, sizeof serversig));
+	read_all(fd, &reply, sizeof reply);
+	if (s0 != HANDSHAKE_PLAINTEXT) {
+		throw std::runtime_error("unsupported handshake");
+	}
+
+	Encoder invoke;
+	amf_write(&invoke, "connect");
+	amf_write(&invoke, 1.0);
+	Arena arena;
+	amf_write(&invoke, AMFValue::object(&arena, {
+		{"app", opts.app},
+		{"flashVer", "rtmpbench"},
+	}));
+	send_invoke(fd, CONTROL_ID, invoke);
+
+	invoke.buf.clear();
+	amf_write(&invoke, "createStream");
+	amf_write(&invoke, 2.0);
+	amf_write_null(&invoke);
+	send_invoke(fd, CONTROL_ID, invoke);
+	return fd;
+}
+
+/* Throws away whatever the server sends to the publisher */
+void drain(int fd)
+{
+	char buf[4096];
+	while (recv(fd, buf, sizeof buf, MSG_DONTWAIT) > 0) {
+	}
+}
+
+void run_publisher(int fd)
+{
+	Encoder invoke;
+	amf_write(&invoke, "publish");
+	amf_write(&invoke, 3.0);
+	amf_write_null(&invoke);
+	amf_write(&invoke, opts.stream);
+	amf_write(&invoke, "live");
+	send_invoke(fd, STREAM_ID, invoke);
+
+	uint32_t chunk_len = htonl(PUBLISH_CHUNK_LEN);
+	write_all(fd, chunk_message(CHAN_CONTROL, MSG_SET_CHUNK, CONTROL_ID, 0,
+				    std::string((char *) &chunk_len, 4),
+				    DEFAULT_CHUNK_LEN));
+
+	/* a keyframe is as large as five inter frames */
+	size_t frame_len = opts.bitrate * 1000 / 8 / FRAME_RATE;
+	size_t inter_len = frame_len * GOP_LEN / (GOP_LEN + 4);
+	std::string inter(std::max(inter_len, size_t(16)), 'i');
+	std::string key(inter.size() * 5, 'k');
+	std::string audio(AUDIO_FRAME_LEN, 'a');
+	audio[0] = char(FLV_AUDIO_AAC << 4 | 0x0f);
+	audio[1] = 1;
+
+	uint64_t start = now_us();
+	unsigned long frame = 0, audio_frame = 0;
+	while (running) {
+		unsigned long elapsed = (now_us() - start) / 1000;
+		while (frame * 1000 / FRAME_RATE <= elapsed) {
+			std::string &buf = frame % GOP_LEN ? inter : key;
+			buf[0] = frame % GOP_LEN ?
+				 char(FLV_INTER_FRAME << 4 | FLV_CODEC_AVC) :
+				 char(FLV_KEY_FRAME << 4 | FLV_CODEC_AVC);
+			buf[1] = 1;
+			uint64_t sent = now_us();
+			memcpy(&buf[TIME_OFFSET], &sent, 8);
+			write_all(fd, chunk_message(CHAN_STREAM, MSG_VIDEO,
+					STREAM_ID,
+					frame * 1000 / FRAME_RATE, buf,
+					PUBLISH_CHUNK_LEN));
+			frame++;
+		}
+		while (audio_frame * AUDIO_INTERVAL <= elapsed) {
+			write_all(fd, chunk_message(CHAN_STREAM, MSG_AUDIO,
+					STREAM_ID,
+					audio_frame * AUDIO_INTERVAL, audio,
+					PUBLISH_CHUNK_LEN));
+			audio_frame++;
+		}
+		drain(fd);
+		usleep(1000);
+	}
+}
+
+void handle_message(Viewer *viewer, const InChunk *msg,
+		    std::vector<uint32_t> *latencies)
+{
+	switch (msg->type) {
+	case MSG_SET_CHUNK:
+		if (msg->len >= 4) {
+			viewer->chunk_len = load_be32(msg->head);
+		}
+		break;
+
+	case MSG_VIDEO: {
+		viewer->frames++;
+		if (viewer->video_seen &&
+		    msg->timestamp - viewer->video_ts > viewer->max_gap) {
+			viewer->max_gap = msg->timestamp - viewer->video_ts;
+		}
+		viewer->video_seen = true;
+		viewer->video_ts = msg->timestamp;
+		if (msg->len < TIME_OFFSET + 8)
+			break;
+		uint64_t sent;
+		memcpy(&sent, &msg->head[TIME_OFFSET], 8);
+		/* frames from the GOP cache are older than the measurement */
+		if (sent >= measure_start) {
+			latencies->push_back(now_us() - sent);
+		}
+		}
+		break;
+	}
+}
+
+/* Parses as many chunks as have been received */
+void parse_chunks(Viewer *viewer, std::vector<uint32_t> *latencies)
+{
+	const uint8_t *data = (const uint8_t *) viewer->buf.data();
+	size_t len = viewer->buf.size();
+	size_t pos = 0;
+	while (pos < len) {
+		if (viewer->chunk_left == 0) {
+			static const size_t header_lens[] = {12, 8, 4, 1};
+			uint8_t flags = data[pos];
+			int fmt = flags >> 6;
+			size_t header_len = header_lens[fmt];
+			if (pos + header_len > len)
+				break;
+			if ((flags & 0x3f) < 2) {
+				throw std::runtime_error("unsupported chunk stream");
+			}
+			InChunk *chunk = &viewer->chunks[flags & 0x3f];
+			const uint8_t *header = &data[pos + 1];
+			uint32_t ts = 0;
+			bool extended = chunk->extended;
+			if (fmt <= 2) {
+				ts = load_be24(header);
+				extended = ts == 0xffffff;
+			}
+			if (extended) {
+				if (pos + header_len + 4 > len)
+					break;
+				if (fmt <= 2) {
+					ts = load_be32(&data[pos + header_len]);
+				}
+				header_len += 4;
+			}
+			if (fmt <= 1) {
+				chunk->len = load_be24(&header[3]);
+				chunk->type = header[6];
+			}
+			chunk->extended = extended;
+			if (chunk->pos == 0) {
+				if (fmt == 0) {
+					chunk->timestamp = ts;
+					chunk->delta = 0;
+				} else if (fmt <= 2) {
+					chunk->delta = ts;
+					chunk->timestamp += ts;
+				} else {
+					chunk->timestamp += chunk->delta;
+				}
+			}
+			pos += header_len;
+			viewer->chunk = chunk;
+			viewer->chunk_left = std::min(chunk->len - chunk->pos,
+						      viewer->chunk_len);
+			if (chunk->len == 0) {
+				handle_message(viewer, chunk, latencies);
+				continue;
+			}
+		}
+
+		InChunk *chunk = viewer->chunk;
+		size_t n = std::min(viewer->chunk_left, len - pos);
+		if (chunk->pos < sizeof chunk->head) {
+			size_t head = std::min(n, sizeof chunk->head - chunk->pos);
+			memcpy(&chunk->head[chunk->pos], &data[pos], head);
+		}
+		chunk->pos += n;
+		viewer->chunk_left -= n;
+		pos += n;
+		if (chunk->pos == chunk->len) {
+			handle_message(viewer, chunk, latencies);
+			chunk->pos = 0;
+		}
+	}
+	viewer->buf.erase(0, pos);
+}
+
+Viewer *new_viewer()
+{
+	Viewer *viewer = new Viewer;
+	viewer->fd = connect_server();
+	viewer->chunk_len = DEFAULT_CHUNK_LEN;
+	viewer->chunk = NULL;
+	viewer->chunk_left = 0;
+	viewer->bytes = 0;
+	viewer->frames = 0;
+	viewer->video_seen = false;
+	viewer->video_ts = 0;
+	viewer->max_gap = 0;
+	for (int i = 0; i < 64; ++i) {
+		viewer->chunks[i].len = 0;
+		viewer->chunks[i].pos = 0;
+		viewer->chunks[i].timestamp = 0;
+		viewer->chunks[i].delta = 0;
+		viewer->chunks[i].extended = false;
+	}
+
+	Encoder invoke;
+	amf_write(&invoke, "play");
+	amf_write(&invoke, 3.0);
+	amf_write_null(&invoke);
+	amf_write(&invoke, opts.stream);
+	send_invoke(viewer->fd, STREAM_ID, invoke);
+
+	fcntl(viewer->fd, F_SETFL, fcntl(viewer->fd, F_GETFL) | O_NONBLOCK);
+	return viewer;
+}
+
+/* Reads from the viewers until the time is up */
+void run_viewers(std::vector<Viewer *> &viewers, uint64_t end,
+		 std::vector<uint32_t> *latencies)
+{
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		throw std::runtime_error(strf("epoll_create1() failed: %s",
+					      strerror(errno)));
+	}
+	FOR_EACH(std::vector<Viewer *>, i, viewers) {
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = *i;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, (*i)->fd, &ev);
+	}
+
+	char buf[65536];
+	epoll_event events[256];
+	while (now_us() < end) {
+		int count = epoll_wait(epoll_fd, events, 256, 100);
+		for (int i = 0; i < count; ++i) {
+			Viewer *viewer = (Viewer *) events[i].data.ptr;
+			ssize_t got = read(viewer->fd, buf, sizeof buf);
+			if (got == 0) {
+				throw std::runtime_error("a viewer was disconnected");
+			} else if (got < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				throw std::runtime_error(strf("read() failed: %s",
+							      strerror(errno)));
+			}
+			viewer->bytes += got;
+			viewer->buf.append(buf, got);
+			parse_chunks(viewer, latencies);
+		}
+	}
+	close(epoll_fd);
+}
+
+/* CPU time used by a process, in seconds */
+double process_cpu(int pid)
+{
+	FILE *f = fopen(strf("/proc/%d/stat", pid).c_str(), "r");
+	if (f == NULL)
+		return 0;
+	char line[1024];
+	double cpu = 0;
+	if (fgets(line, sizeof line, f)) {
+		/* skip over the command name, which may contain spaces */
+		const char *p = strrchr(line, ')');
+		unsigned long utime, stime;
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+				"%*u %*u %lu %lu", &utime, &stime) == 2) {
+			cpu = double(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+	}
+	fclose(f);
+	return cpu;
+}
+
+/* Resident set size of a process, in KB */
+unsigned long process_rss(int pid)
+{
+	FILE *f = fopen(strf("/proc/%d/status", pid).c_str(), "r");
+	if (f == NULL)
+		return 0;
+	char line[256];
+	unsigned long rss = 0;
+	while (fgets(line, sizeof line, f)) {
+		if (sscanf(line, "VmRSS: %lu", &rss) == 1)
+			break;
+	}
+	fclose(f);
+	return rss;
+}
+
+double percentile(const std::vector<uint32_t> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = std::min(size_t(p * sorted.size()), sorted.size() - 1);
+	return sorted[i] / 1000.0;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-h host] [-p port] [-a app] [-s stream] "
+		"[-n viewers] [-b kbit/s] [-t seconds] [-j join after seconds] "
+		"[-P server pid]\n", prog);
+	exit(1);
+}
+
+}
+
+int main(int argc, char **argv)
+try {
+	opts.host = "127.0.0.1";
+	opts.port = PORT;
+	opts.app = "live";
+	opts.stream = "bench";
+	opts.viewers = 100;
+	opts.bitrate = 2000;
+	opts.duration = 10;
+	opts.join_delay = 0;
+	opts.server_pid = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "h:p:a:s:n:b:t:j:P:")) != -1) {
+		switch (c) {
+		case 'h':
+			opts.host = optarg;
+			break;
+		case 'p':
+			opts.port = atoi(optarg);
+			break;
+		case 'a':
+			opts.app = optarg;
+			break;
+		case 's':
+			opts.stream = optarg;
+			break;
+		case 'n':
+			opts.viewers = atoi(optarg);
+			break;
+		case 'b':
+			opts.bitrate = atoi(optarg);
+			break;
+		case 't':
+			opts.duration = atoi(optarg);
+			break;
+		case 'j':
+			opts.join_delay = atoi(optarg);
+			break;
+		case 'P':
+			opts.server_pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	int publisher_fd = connect_server();
+	std::thread publisher(run_publisher, publisher_fd);
+	/* late joiners start from the GOP cache, far into the stream */
+	sleep(opts.join_delay);
+
+	std::vector<Viewer *> viewers;
+	for (size_t i = 0; i < opts.viewers; ++i) {
+		viewers.push_back(new_viewer());
+	}
+	printf("%zu viewers connected, streaming %lu kbit/s for %lu s\n",
+	       viewers.size(), opts.bitrate, opts.duration);
+
+	/* let the viewers catch up with the GOP burst before measuring */
+	std::vector<uint32_t> latencies;
+	run_viewers(viewers, now_us() + 1000000, &latencies);
+
+	FOR_EACH(std::vector<Viewer *>, i, viewers) {
+		(*i)->bytes = 0;
+		(*i)->frames = 0;
+	}
+	double cpu = 0;
+	if (opts.server_pid) {
+		cpu = process_cpu(opts.server_pid);
+	}
+	latencies.clear();
+	uint64_t start = now_us();
+	measure_start = start;
+	run_viewers(viewers, start + opts.duration * 1000000, &latencies);
+	double elapsed = (now_us() - start) / 1e6;
+
+	running = false;
+	publisher.join();
+
+	uint64_t total_bytes = 0, total_frames = 0;
+	uint32_t max_gap = 0;
+	FOR_EACH(std::vector<Viewer *>, i, viewers) {
+		total_bytes += (*i)->bytes;
+		total_frames += (*i)->frames;
+		max_gap = std::max(max_gap, (*i)->max_gap);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	double expected = elapsed * FRAME_RATE * viewers.size();
+
+	printf("egress:   %.1f MB/s, %.0f video frames/s (%.1f%% of sent)\n",
+	       total_bytes / elapsed / 1e6, total_frames / elapsed,
+	       expected > 0 ? total_frames * 100 / expected : 0);
+	printf("latency:  p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+	       percentile(latencies, 0.5), percentile(latencies, 0.9),
+	       percentile(latencies, 0.99), percentile(latencies, 1.0));
+	if (opts.server_pid) {
+		cpu = process_cpu(opts.server_pid) - cpu;
+		printf("server:   %.1f%% CPU, %lu KB RSS\n",
+		       cpu * 100 / elapsed, process_rss(opts.server_pid));
+	}
+	printf("gaps:     up to %u ms between video frames\n", max_gap);
+	/* video dropped from an uncongested viewer is a bug */
+	if (opts.join_delay && max_gap > 1000 / FRAME_RATE) {
+		fprintf(stderr, "ERROR: late joiners lost video\n");
+		return 1;
+	}
+	return 0;
+} catch (const std::runtime_error &e) {
+	fprintf(stderr, "ERROR: %s\n", e.what());
+	return 1;
+}
@@ -0,0 +1,172 @@
+#include "vod.h"
+#include "flv.h"
+#include "rtmp.h"
+#include "utils.h"
+#include <mutex>
+#include <unordered_map>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+typedef std::unordered_map<std::string, std::shared_ptr<VodFile> > vod_cache_t;
+
+std::mutex cache_lock;
+vod_cache_t cache;
+
+}
+
+VodFile::VodFile(const std::string &path, int fd) :
+	m_fd(fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		throw std::runtime_error(strf("unable to stat %s: %s",
+					      path.c_str(), strerror(errno)));
+	}
+	m_size = st.st_size;
+	m_mtime = st.st_mtime;
+	if (m_size < FLV_HEADER_LEN + FLV_TAG_SIZE) {
+		throw std::runtime_error("not an FLV file: " + path);
+	}
+	void *data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		throw std::runtime_error(strf("unable to map %s: %s",
+					      path.c_str(), strerror(errno)));
+	}
+	m_data = (const char *) data;
+
+	if (memcmp(m_data, "FLV", 3) != 0 ||
+	    load_be32(&m_data[5]) < FLV_HEADER_LEN) {
+		munmap(data, m_size);
+		throw std::runtime_error("not an FLV file: " + path);
+	}
+	/* skip the header and the size of the non-existent previous tag */
+	m_first = load_be32(&m_data[5]) + FLV_TAG_SIZE;
+
+	/* seeking before the first keyframe starts from the beginning */
+	KeyFrame start;
+	start.timestamp = 0;
+	start.offset = m_first;
+	m_keyframes.push_back(start);
+
+	FlvTag flv;
+	m_end = m_size;
+	size_t offset = m_first;
+	uint8_t seen = 0; /* header tag types found, by bit */
+	while (tag(offset, &flv)) {
+		bool header = flv.type == MSG_NOTIFY ||
+			flv_is_sequence_header(flv.type, flv.data, flv.len);
+		if (header) {
+			uint8_t bit = 1 << (flv.type & 7);
+			if (!(seen & bit))
+				m_headers.push_back(offset);
+			seen |= bit;
+		} else if (flv_is_keyframe(flv.type, flv.data, flv.len)) {
+			KeyFrame key;
+			key.timestamp = flv.timestamp;
+			key.offset = offset;
+			m_keyframes.push_back(key);
+		}
+		offset = flv.next;
+	}
+	/* a file still being recorded may end with a partial tag */
+	m_end = offset;
+}
+
+VodFile::~VodFile()
+{
+	munmap((void *) m_data, m_size);
+	close(m_fd);
+}
+
+bool VodFile::tag(size_t offset, FlvTag *tag) const
+{
+	if (offset + FLV_TAG_HEADER > m_end)
+		return false;
+	const char *header = &m_data[offset];
+	uint8_t type;
+	unsigned long timestamp;
+	size_t len = flv_read_tag_header(header, &type, &timestamp);
+	if (offset + FLV_TAG_HEADER + len + FLV_TAG_SIZE > m_end)
+		return false;
+	tag->type = type;
+	tag->timestamp = timestamp;
+	tag->data = header + FLV_TAG_HEADER;
+	tag->len = len;
+	tag->next = offset + FLV_TAG_HEADER + len + FLV_TAG_SIZE;
+	return true;
+}
+
+const KeyFrame &VodFile::seek(unsigned long timestamp) const
+{
+	/* the keyframes are in timestamp order, find the last one not after */
+	size_t lo = 0, hi = m_keyframes.size();
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (m_keyframes[mid].timestamp <= timestamp)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return m_keyframes[lo];
+}
+
+bool VodFile::current(const struct stat *st) const
+{
+	return size_t(st->st_size) == m_size && st->st_mtime == m_mtime;
+}
+
+bool VodFile::truncated() const
+{
+	struct stat st;
+	return fstat(m_fd, &st) < 0 || size_t(st.st_size) < m_end;
+}
+
+std::shared_ptr<VodFile> open_vod(const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+		std::lock_guard<std::mutex> lock(cache_lock);
+		cache.erase(path);
+		return std::shared_ptr<VodFile>();
+	}
+	{
+		std::lock_guard<std::mutex> lock(cache_lock);
+		vod_cache_t::iterator i = cache.find(path);
+		if (i != cache.end() && i->second->current(&st)) {
+			return i->second;
+		}
+	}
+
+	/* indexed without the lock, other files can be opened meanwhile */
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(strf("unable to open %s: %s",
+					      path.c_str(), strerror(errno)));
+	}
+	std::shared_ptr<VodFile> file;
+	try {
+		file = std::make_shared<VodFile>(path, fd);
+	} catch (const std::runtime_error &) {
+		close(fd);
+		throw;
+	}
+
+	std::lock_guard<std::mutex> lock(cache_lock);
+	/* unmap the files nobody plays any more */
+	for (vod_cache_t::iterator i = cache.begin(); i != cache.end(); ) {
+		if (i->second.use_count() == 1) {
+			i = cache.erase(i);
+		} else {
+			++i;
+		}
+	}
+	cache[path] = file;
+	return file;
+}
@@ -0,0 +1,78 @@
+#ifndef __vod_h
+#define __vod_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct KeyFrame {
+	unsigned long timestamp;
+	size_t offset; /* of the tag */
+};
+
+struct FlvTag {
+	uint8_t type; /* same as the RTMP message type */
+	unsigned long timestamp;
+	const char *data;
+	size_t len;
+	size_t next; /* offset of the following tag */
+};
+
+/*
+ * A memory-mapped FLV file with an index of its keyframes. Immutable once
+ * opened, so the workers share it without locking. Tag data is sent to the
+ * clients straight from the mapping.
+ */
+class VodFile {
+public:
+	/*
+	 * Maps and indexes the file, throws if it is not a valid FLV file.
+	 * Takes over the descriptor unless it throws.
+	 */
+	VodFile(const std::string &path, int fd);
+	~VodFile();
+
+	size_t first_tag() const { return m_first; }
+
+	/* Parses the tag at the offset, returns false at the end of file */
+	bool tag(size_t offset, FlvTag *tag) const;
+
+	/* The last keyframe at or before the timestamp */
+	const KeyFrame &seek(unsigned long timestamp) const;
+
+	/* Metadata and sequence header tags, to send again after a seek */
+	const std::vector<size_t> &headers() const { return m_headers; }
+
+	/* Tells if the file on disk is still the one mapped */
+	bool current(const struct stat *st) const;
+
+	/*
+	 * Tells if the file has been cut short since it was indexed. Reading
+	 * the lost part of the mapping would raise SIGBUS.
+	 */
+	bool truncated() const;
+
+private:
+	int m_fd;
+	const char *m_data;
+	size_t m_size;
+	size_t m_first;
+	size_t m_end; /* after the last complete tag */
+	time_t m_mtime;
+	std::vector<KeyFrame> m_keyframes;
+	std::vector<size_t> m_headers;
+
+	VodFile(const VodFile &);
+	void operator = (const VodFile &);
+};
+
+/*
+ * Opens a file through a cache shared by all workers, so a file is mapped
+ * and indexed only once while it is being played. Returns NULL if there is
+ * no such file.
+ */
+std::shared_ptr<VodFile> open_vod(const std::string &path);
+
+#endif